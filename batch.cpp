@@ -0,0 +1,183 @@
+#include "batch.hpp"
+#include "stitcher.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+using namespace cv;
+
+Batch_stitcher::Batch_stitcher(const vector<pair<string, string> > &options_, int num_workers_, int prefetch_depth_, int decode_threads_)
+{
+    options = options_;
+    num_workers = max(1, num_workers_);
+    prefetch_depth = prefetch_depth_;
+    decode_threads = decode_threads_;
+}
+
+static bool is_image_file(const string &name)
+{
+    const char* extensions[] = {".jpg", ".jpeg", ".png", ".tif", ".tiff", ".bmp"};
+    size_t dot = name.rfind('.');
+    if(dot == string::npos)
+        return false;
+
+    string ext = name.substr(dot);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    for(int i = 0; i < 6; i++)
+    {
+        if(ext == extensions[i])
+            return true;
+    }
+    return false;
+}
+
+bool Batch_stitcher::load_manifest(const string &manifest)
+{
+    ifstream in(manifest.c_str());
+    if(!in)
+    {
+        STICHER_DBG_ERR("can not open manifest " << manifest);
+        return false;
+    }
+
+    sets.clear();
+    string line;
+    while(getline(in, line))
+    {
+        if(line.empty() || line[0] == '#')
+            continue;
+
+        image_set set;
+        set.source = line;
+        if(line.find(',') != string::npos)
+        {
+            size_t start = 0;
+            while(start <= line.size())
+            {
+                size_t end = line.find(',', start);
+                if(end == string::npos)
+                    end = line.size();
+                if(end > start)
+                    set.files.push_back(line.substr(start, end - start));
+                start = end + 1;
+            }
+        }
+        else
+        {
+            vector<String> found;
+            glob(line + "/*", found, false);
+            for(int i = 0; i < found.size(); i++)
+            {
+                if(is_image_file(found[i]))
+                    set.files.push_back(found[i]);
+            }
+        }
+        sets.push_back(set);
+    }
+
+    STICHER_DBG_OUT(sets.size() << " image sets in " << manifest);
+    return true;
+}
+
+void Batch_stitcher::worker(const string &out_dir)
+{
+    while(true)
+    {
+        Image_loader::loaded_set current;
+        int64 start = getTickCount();
+        if(!loader->next(current))
+            break;
+
+        set_result &result = results[current.idx];
+        result.ok = false;
+        result.error = current.error;
+        result.load_ms = current.load_ms;
+        result.wait_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        result.stitch_ms = 0;
+        result.write_ms = 0;
+        if(result.error.empty() && current.imgs.size() < 2)
+            result.error = "less than two images";
+        if(!result.error.empty())
+            continue;
+
+        // a stitcher per set, the sets are different rigs and must not warm start from each other's cameras
+        Basic_stitcher stitcher(false);
+        for(int i = 0; i < options.size(); i++)
+            stitcher.set_option(options[i].first, options[i].second);
+
+        // OpenCV reports bad input (too few matches, degenerate homographies) by throwing
+        Mat pano;
+        start = getTickCount();
+        try
+        {
+            stitcher.stitcher_do_all(current.imgs).convertTo(pano, CV_8U);
+        }
+        catch(const cv::Exception &e)
+        {
+            result.error = e.what();
+        }
+        result.stitch_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        current.imgs.clear();
+
+        if(result.error.empty() && pano.empty())
+            result.error = "empty panorama";
+        if(!result.error.empty())
+            continue;
+
+        char name[64];
+        snprintf(name, sizeof(name), "/set_%06d.jpg", current.idx);
+        result.output = out_dir + name;
+
+        start = getTickCount();
+        result.ok = imwrite(result.output, pano);
+        if(!result.ok)
+            result.error = "can not write " + result.output;
+        result.write_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+    }
+}
+
+bool Batch_stitcher::run(const string &out_dir, const string &report)
+{
+    results.assign(sets.size(), set_result());
+    loader = makePtr<Image_loader>([this](int idx, vector<string> &files)
+    {
+        if(idx >= (int)sets.size())
+            return false;
+        files = sets[idx].files;
+        return true;
+    }, prefetch_depth, decode_threads);
+
+    int64 start = getTickCount();
+    vector<thread> workers;
+    for(int i = 0; i < num_workers; i++)
+        workers.push_back(thread(&Batch_stitcher::worker, this, out_dir));
+    for(int i = 0; i < workers.size(); i++)
+        workers[i].join();
+    double total_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+    ofstream out(report.c_str());
+    if(!out)
+    {
+        STICHER_DBG_ERR("can not write report " << report);
+        return false;
+    }
+
+    int failed = 0;
+    out << "index\tstatus\tload_ms\twait_ms\tstitch_ms\twrite_ms\tsource\terror" << endl;
+    for(int i = 0; i < results.size(); i++)
+    {
+        // error messages of cv::Exception span several lines
+        string error = results[i].error;
+        replace(error.begin(), error.end(), '\n', ' ');
+        replace(error.begin(), error.end(), '\t', ' ');
+
+        out << i << "\t" << (results[i].ok ? "ok" : "failed") << "\t" << results[i].load_ms << "\t" << results[i].wait_ms << "\t" << results[i].stitch_ms
+            << "\t" << results[i].write_ms << "\t" << sets[i].source << "\t" << error << endl;
+        if(!results[i].ok)
+            failed++;
+    }
+
+    STICHER_DBG_OUT(sets.size() << " sets, " << failed << " failed, " << total_ms / 1000.0 << " s");
+    return true;
+}
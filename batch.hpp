@@ -0,0 +1,55 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "frame_source.hpp"
+
+// Offline stitching of many independent image sets. The manifest has one set per line, either a directory
+// (all image files in it, sorted by name) or a comma separated list of files. Sets are handed out to
+// num_workers threads, each with its own Basic_stitcher configured by the given set_option pairs. Sets are
+// read and decoded ahead by one shared Image_loader (prefetch_depth sets, decode_threads threads). Every set
+// ends up in out_dir/set_<index>.jpg and one report line (index, status, load/wait/stitch/write milliseconds,
+// source), where wait is the time a worker sat idle waiting for the loader.
+class Batch_stitcher
+{
+    public:
+    Batch_stitcher(const std::vector<std::pair<std::string, std::string> > &options_, int num_workers_ = 4
+                    , int prefetch_depth_ = 8, int decode_threads_ = 4);
+
+    bool                                    load_manifest           (const std::string &manifest);
+    bool                                    run                     (const std::string &out_dir, const std::string &report);
+
+    private:
+    struct image_set
+    {
+        std::string source;
+        std::vector<std::string> files;
+    };
+
+    struct set_result
+    {
+        bool ok;
+        std::string error;
+        double load_ms;
+        double wait_ms;
+        double stitch_ms;
+        double write_ms;
+        std::string output;
+    };
+
+    void                                    worker                  (const std::string &out_dir);
+
+    std::vector<std::pair<std::string, std::string> > options;
+    int num_workers;
+    int prefetch_depth;
+    int decode_threads;
+    cv::Ptr<Image_loader> loader;
+    std::vector<image_set> sets;
+    std::vector<set_result> results;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include "frame_sink.hpp"
+#include "frame_source.hpp"
+#include "stitcher.hpp"
+
+#include <cerrno>
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+using namespace cv;
+
+Stream_sink::Stream_sink(const string &path, output_format format_, int fps_)
+{
+    format = format_;
+    fps = fps_;
+    fd = Stream_source::open_stream(path, true);
+    if(fd < 0)
+        STICHER_DBG_ERR("can not open output " << path);
+}
+
+Stream_sink::~Stream_sink()
+{
+    if(fd > STDERR_FILENO)
+        close(fd);
+}
+
+bool Stream_sink::write_exact(int fd, const void *data, size_t size)
+{
+    const char* src = (const char*)data;
+    while(size > 0)
+    {
+        ssize_t n = ::write(fd, src, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        src += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool Stream_sink::start(Size frame_size)
+{
+    if(size.area() > 0)
+        return true;
+
+    size = frame_size;
+    if(format != OUT_BGR24)
+        size = Size(size.width & ~1, size.height & ~1);
+
+    if(format == OUT_Y4M)
+    {
+        ostringstream header;
+        header << "YUV4MPEG2 W" << size.width << " H" << size.height << " F" << fps << ":1 Ip A1:1 C420jpeg\n";
+        return write_exact(fd, header.str().data(), header.str().size());
+    }
+    return true;
+}
+
+bool Stream_sink::write(const Mat &pano)
+{
+    if(fd < 0 || pano.empty())
+        return false;
+
+    if(!start(pano.size()))
+        return false;
+
+    // 8-bit BGR of the stream size goes out as it is
+    const Mat* frame = &pano;
+    if(pano.size() != size || pano.type() != CV_8UC3 || !pano.isContinuous())
+    {
+        bgr.create(size, CV_8UC3);
+        Rect common(0, 0, min(size.width, pano.cols), min(size.height, pano.rows));
+        if(common.size() != size)
+            bgr.setTo(Scalar::all(0));
+
+        Mat dst = bgr(common);
+        if(pano.channels() == 3)
+            pano(common).convertTo(dst, CV_8U);
+        else
+        {
+            Mat gray;
+            pano(common).convertTo(gray, CV_8U);
+            cvtColor(gray, dst, COLOR_GRAY2BGR);
+        }
+        frame = &bgr;
+    }
+
+    if(format == OUT_BGR24)
+        return write_exact(fd, frame->data, frame->total() * frame->elemSize());
+
+    cvtColor(*frame, yuv, COLOR_BGR2YUV_I420);
+    if(format == OUT_Y4M && !write_exact(fd, "FRAME\n", 6))
+        return false;
+
+    return write_exact(fd, yuv.data, yuv.total() * yuv.elemSize());
+}
+
+bool Stream_sink::write_yuv(const Mat &i420)
+{
+    if(fd < 0 || i420.empty())
+        return false;
+
+    if(format == OUT_BGR24)
+    {
+        // not into bgr, write() reallocates it for a new panorama size while reading its input
+        Mat converted;
+        cvtColor(i420, converted, COLOR_YUV2BGR_I420);
+        return write(converted);
+    }
+
+    Size frame_size(i420.cols, i420.rows * 2 / 3);
+    if(!start(frame_size))
+        return false;
+
+    // crop or pad plane by plane into the reused output buffer
+    const Mat* frame = &i420;
+    if(frame_size != size)
+    {
+        yuv.create(size.height * 3 / 2, size.width, CV_8UC1);
+        Size chroma(size.width / 2, size.height / 2);
+        Size src_chroma(frame_size.width / 2, frame_size.height / 2);
+        Mat dst_planes[3] = {yuv.rowRange(0, size.height), Mat(chroma, CV_8UC1, yuv.ptr(size.height))
+                            , Mat(chroma, CV_8UC1, yuv.ptr(size.height) + chroma.area())};
+        Mat src_planes[3] = {i420.rowRange(0, frame_size.height), Mat(src_chroma, CV_8UC1, (void*)i420.ptr(frame_size.height))
+                            , Mat(src_chroma, CV_8UC1, (void*)(i420.ptr(frame_size.height) + src_chroma.area()))};
+
+        for(int p = 0; p < 3; p++)
+        {
+            Rect common(0, 0, min(dst_planes[p].cols, src_planes[p].cols), min(dst_planes[p].rows, src_planes[p].rows));
+            if(common.size() != dst_planes[p].size())
+                dst_planes[p].setTo(Scalar::all(p == 0 ? 0 : 128));
+            src_planes[p](common).copyTo(dst_planes[p](common));
+        }
+        frame = &yuv;
+    }
+
+    if(format == OUT_Y4M && !write_exact(fd, "FRAME\n", 6))
+        return false;
+
+    return write_exact(fd, frame->data, frame->total());
+}
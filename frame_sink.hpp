@@ -0,0 +1,42 @@
+#ifndef FRAME_SINK_HPP
+#define FRAME_SINK_HPP
+
+#include <string>
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+// Panoramas as raw BGR, raw I420 or Y4M (C420jpeg) frames on stdout ("-"), a FIFO, a file or a Unix socket
+// ("unix:/path"), for piping into an external encoder. The frame size is fixed by the first frame (rounded
+// down to even for I420), later frames are cropped or zero padded to it. Conversion buffers are allocated
+// once, each frame goes out in one large write, and 8-bit BGR frames of the right size are written in place.
+class Stream_sink
+{
+    public:
+    enum output_format
+    {
+        OUT_BGR24,
+        OUT_I420,
+        OUT_Y4M
+    };
+
+    Stream_sink(const std::string &path, output_format format_ = OUT_Y4M, int fps_ = 30);
+    ~Stream_sink();
+
+    bool                                    write                   (const cv::Mat &pano);
+    // I420 panoramas (CV_8UC1, rows * 3 / 2) as made by Basic_stitcher::stitcher_do_frame_yuv, written without
+    // a color conversion unless the output is BGR. Padding is black.
+    bool                                    write_yuv               (const cv::Mat &i420);
+    static bool                             write_exact             (int fd, const void *data, size_t size);
+
+    private:
+    bool                                    start                   (cv::Size frame_size);
+
+    int fd;
+    output_format format;
+    int fps;
+    cv::Size size;
+    cv::Mat bgr;
+    cv::Mat yuv;
+};
+
+#endif
@@ -0,0 +1,677 @@
+#include "frame_source.hpp"
+#include "stitcher.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+using namespace cv;
+using namespace moodycamel;
+
+Image_loader::Image_loader(set_list list_, int depth_, int num_threads_)
+{
+    list = list_;
+    depth = max(1, depth_);
+    num_threads = max(1, num_threads_);
+    first_index = 0;
+    next_index = 0;
+    started = false;
+    ended = false;
+    stop = false;
+}
+
+Image_loader::~Image_loader()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    job_ready.notify_all();
+
+    for(int i = 0; i < decoders.size(); i++)
+        decoders[i].join();
+}
+
+void Image_loader::set_decode_flags(const vector<int> &flags)
+{
+    lock_guard<mutex> guard(lock);
+    if(started)
+    {
+        STICHER_DBG_ERR("decode flags must be set before the first read");
+        return;
+    }
+    decode_flags = flags;
+}
+
+bool Image_loader::schedule()
+{
+    // called with the lock held, adds set next_index to the window and queues its files
+    if(ended)
+        return false;
+
+    pending_set set;
+    if(!list(next_index, set.files))
+    {
+        ended = true;
+        return false;
+    }
+
+    set.loaded.idx = next_index;
+    set.loaded.imgs.resize(set.files.size());
+    set.loaded.load_ms = 0;
+    set.remaining = set.files.size();
+    if(set.files.empty())
+        set.loaded.error = "empty set";
+    window.push_back(set);
+
+    for(int i = 0; i < set.files.size(); i++)
+        jobs.push(make_pair(next_index, i));
+    next_index++;
+    job_ready.notify_all();
+
+    return true;
+}
+
+void Image_loader::decode_thread()
+{
+    while(true)
+    {
+        pair<int, int> job;
+        string file;
+        int flag;
+        {
+            unique_lock<mutex> guard(lock);
+            job_ready.wait(guard, [this]{ return stop || !jobs.empty(); });
+            if(stop)
+                return;
+            job = jobs.front();
+            jobs.pop();
+            file = window[job.first - first_index].files[job.second];
+            flag = (job.second < decode_flags.size()) ? decode_flags[job.second] : IMREAD_COLOR;
+        }
+
+        // read the whole file first, so the decode does not interleave with disk waits
+        int64 start = getTickCount();
+        Mat img;
+        ifstream in(file.c_str(), ios::binary);
+        if(in)
+        {
+            // one read into a buffer of the file size
+            in.seekg(0, ios::end);
+            streamoff size = in.tellg();
+            in.seekg(0, ios::beg);
+            if(size > 0)
+            {
+                vector<uchar> data((size_t)size);
+                if(in.read((char*)data.data(), size))
+                    img = imdecode(data, flag);
+            }
+        }
+        double ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+        {
+            lock_guard<mutex> guard(lock);
+            pending_set &set = window[job.first - first_index];
+            set.loaded.imgs[job.second] = img;
+            set.loaded.load_ms += ms;
+            if(img.empty() && set.loaded.error.empty())
+                set.loaded.error = "can not read " + file;
+            set.remaining--;
+        }
+        set_ready.notify_all();
+    }
+}
+
+bool Image_loader::next(loaded_set &set)
+{
+    unique_lock<mutex> guard(lock);
+    if(!started)
+    {
+        started = true;
+        for(int i = 0; i < num_threads; i++)
+            decoders.push_back(thread(&Image_loader::decode_thread, this));
+        for(int i = 0; i < depth; i++)
+        {
+            if(!schedule())
+                break;
+        }
+    }
+
+    set_ready.wait(guard, [this]{ return window.empty() || window.front().remaining == 0; });
+    if(window.empty())
+        return false;
+
+    set = window.front().loaded;
+    window.pop_front();
+    first_index++;
+    schedule();
+
+    return true;
+}
+
+Image_sequence_source::Image_sequence_source(const vector<string> &patterns_, int first_index)
+{
+    patterns = patterns_;
+    index = first_index;
+    decode_flags.assign(patterns.size(), IMREAD_COLOR);
+}
+
+string Image_sequence_source::file_name(int cam, int index)
+{
+    char name[1024];
+    snprintf(name, sizeof(name), patterns[cam].c_str(), index);
+    return string(name);
+}
+
+vector<Size> Image_sequence_source::full_sizes()
+{
+    // image files carry no cheap size query in OpenCV, decode the first group once at full resolution
+    if(sizes.empty())
+    {
+        for(int i = 0; i < patterns.size(); i++)
+        {
+            Mat img = imread(file_name(i, index), IMREAD_COLOR);
+            sizes.push_back(img.size());
+        }
+    }
+
+    return sizes;
+}
+
+int Image_sequence_source::reduced_decode_flag(double scale)
+{
+    if(scale <= 1.0 / 8)
+        return IMREAD_REDUCED_COLOR_8;
+    if(scale <= 1.0 / 4)
+        return IMREAD_REDUCED_COLOR_4;
+    if(scale <= 1.0 / 2)
+        return IMREAD_REDUCED_COLOR_2;
+
+    return IMREAD_COLOR;
+}
+
+void Image_sequence_source::set_decode_scale(const vector<double> &scales)
+{
+    if(loader)
+    {
+        STICHER_DBG_ERR("decode scale must be set before the first read");
+        return;
+    }
+
+    for(int i = 0; i < patterns.size() && i < scales.size(); i++)
+        decode_flags[i] = reduced_decode_flag(scales[i]);
+}
+
+bool Image_sequence_source::read(vector<Mat> &frames)
+{
+    if(!loader)
+    {
+        // the sequence has no known length, it ends at the first group with a missing file
+        int first = index;
+        loader = makePtr<Image_loader>([this, first](int idx, vector<string> &files)
+        {
+            for(int i = 0; i < patterns.size(); i++)
+                files.push_back(file_name(i, first + idx));
+            return true;
+        });
+        loader->set_decode_flags(decode_flags);
+    }
+
+    Image_loader::loaded_set set;
+    if(!loader->next(set) || !set.error.empty())
+        return false;
+    frames = set.imgs;
+    index++;
+
+    return true;
+}
+
+Video_source::Video_source(const vector<string> &files, int queue_depth_, int first_frame)
+    : ready(queue_depth_), free_slots(queue_depth_)
+{
+    queue_depth = queue_depth_;
+    started = false;
+    stop = false;
+    finished = false;
+
+    for(int i = 0; i < files.size(); i++)
+    {
+        captures.push_back(VideoCapture(files[i]));
+        if(!captures.back().isOpened())
+            STICHER_DBG_ERR("can not open video " << files[i]);
+        if(first_frame > 0)
+            captures.back().set(CAP_PROP_POS_FRAMES, first_frame);
+        sizes.push_back(Size((int)captures.back().get(CAP_PROP_FRAME_WIDTH), (int)captures.back().get(CAP_PROP_FRAME_HEIGHT)));
+    }
+    decode_scales.assign(files.size(), 1.0);
+
+    for(int i = 0; i < queue_depth; i++)
+        free_slots.enqueue(i);
+}
+
+Video_source::~Video_source()
+{
+    stop = true;
+    if(decoder.joinable())
+    {
+        // unblock the decoder if it waits for a free slot
+        free_slots.enqueue(0);
+        decoder.join();
+    }
+}
+
+vector<Size> Video_source::full_sizes()
+{
+    return sizes;
+}
+
+void Video_source::set_decode_scale(const vector<double> &scales)
+{
+    // the decoder thread reads decode_scales, so the scale can only be chosen before the first read
+    if(started)
+    {
+        STICHER_DBG_ERR("decode scale must be set before the first read");
+        return;
+    }
+
+    for(int i = 0; i < decode_scales.size() && i < scales.size(); i++)
+        decode_scales[i] = min(1.0, scales[i]);
+}
+
+void Video_source::decode_thread()
+{
+    while(!stop)
+    {
+        int slot;
+        free_slots.wait_dequeue(slot);
+        if(stop)
+            break;
+
+        vector<Mat> frames(captures.size());
+        bool ok = true;
+        for(int i = 0; i < captures.size(); i++)
+        {
+            Mat decoded;
+            captures[i] >> decoded;
+            if(decoded.empty())
+            {
+                ok = false;
+                break;
+            }
+
+            if(decode_scales[i] < 1.0 - 1e-6)
+                resize(decoded, frames[i], Size(), decode_scales[i], decode_scales[i], INTER_AREA);
+            else
+                frames[i] = decoded;
+        }
+
+        if(!ok)
+        {
+            // an empty group marks the end of the stream
+            ready.enqueue(vector<Mat>());
+            break;
+        }
+        ready.enqueue(frames);
+    }
+}
+
+bool Video_source::read(vector<Mat> &frames)
+{
+    if(!started)
+    {
+        started = true;
+        decoder = thread(&Video_source::decode_thread, this);
+    }
+
+    if(finished)
+        return false;
+
+    ready.wait_dequeue(frames);
+    if(frames.empty())
+    {
+        finished = true;
+        return false;
+    }
+    free_slots.enqueue(0);
+
+    return true;
+}
+
+Stream_source::Stream_source(const vector<string> &paths, int interleaved_cameras)
+{
+    open_streams(paths, interleaved_cameras);
+    for(int i = 0; i < streams.size(); i++)
+    {
+        streams[i].y4m = true;
+        if(!read_y4m_header(streams[i]))
+            STICHER_DBG_ERR("bad y4m header in " << paths[i]);
+    }
+}
+
+Stream_source::Stream_source(const vector<string> &paths, Size frame_size, pixel_format format, int interleaved_cameras)
+{
+    open_streams(paths, interleaved_cameras);
+    for(int i = 0; i < streams.size(); i++)
+    {
+        streams[i].size = frame_size;
+        streams[i].format = format;
+    }
+}
+
+Stream_source::~Stream_source()
+{
+    for(int i = 0; i < streams.size(); i++)
+    {
+        if(streams[i].fd > STDERR_FILENO)
+            close(streams[i].fd);
+    }
+}
+
+void Stream_source::open_streams(const vector<string> &paths, int interleaved_cameras)
+{
+    interleaved = (interleaved_cameras > 0);
+    yuv_output = false;
+    num_cameras = interleaved ? interleaved_cameras : paths.size();
+    pool_size = 4;
+
+    for(int i = 0; i < paths.size(); i++)
+    {
+        stream s;
+        s.fd = open_stream(paths[i], false);
+        if(s.fd < 0)
+            STICHER_DBG_ERR("can not open stream " << paths[i]);
+        s.y4m = false;
+        s.format = PIX_BGR24;
+        streams.push_back(s);
+    }
+
+    decode_scales.assign(num_cameras, 1.0);
+    pools.assign(num_cameras, vector<Mat>());
+}
+
+int Stream_source::open_stream(const string &path, bool for_write)
+{
+    if(path == "-")
+        return for_write ? STDOUT_FILENO : STDIN_FILENO;
+
+    if(path.compare(0, 5, "unix:") == 0)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0)
+            return -1;
+
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str() + 5, sizeof(addr.sun_path) - 1);
+        if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // plain files and FIFOs
+    if(for_write)
+        return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return open(path.c_str(), O_RDONLY);
+}
+
+bool Stream_source::read_exact(int fd, void *data, size_t size)
+{
+    char* dst = (char*)data;
+    while(size > 0)
+    {
+        ssize_t n = ::read(fd, dst, size);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        dst += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool Stream_source::read_line(int fd, string &line)
+{
+    // header lines only, short enough to read byte by byte
+    line.clear();
+    char c;
+    while(line.size() < 4096)
+    {
+        if(!read_exact(fd, &c, 1))
+            return false;
+        if(c == '\n')
+            return true;
+        line.push_back(c);
+    }
+    return false;
+}
+
+bool Stream_source::read_y4m_header(stream &s)
+{
+    string line;
+    if(s.fd < 0 || !read_line(s.fd, line) || line.compare(0, 9, "YUV4MPEG2") != 0)
+        return false;
+
+    s.format = PIX_I420;
+    istringstream tokens(line.substr(9));
+    string token;
+    while(tokens >> token)
+    {
+        if(token[0] == 'W')
+            s.size.width = atoi(token.c_str() + 1);
+        else if(token[0] == 'H')
+            s.size.height = atoi(token.c_str() + 1);
+        else if(token[0] == 'C')
+        {
+            if(token.compare(1, 3, "420") == 0)
+                s.format = PIX_I420;
+            else if(token.compare(1, 4, "mono") == 0)
+                s.format = PIX_GRAY;
+            else
+            {
+                STICHER_DBG_ERR("unsupported y4m colorspace " << token);
+                return false;
+            }
+        }
+    }
+
+    return s.size.area() > 0;
+}
+
+Mat Stream_source::pooled_buffer(int cam, Size size, int type)
+{
+    // a buffer only the pool references is free again
+    vector<Mat> &pool = pools[cam];
+    for(int i = 0; i < pool.size(); i++)
+    {
+        if(pool[i].u && pool[i].u->refcount == 1 && pool[i].size() == size && pool[i].type() == type)
+            return pool[i];
+    }
+
+    Mat buffer(size, type);
+    if(pool.size() < pool_size)
+        pool.push_back(buffer);
+    return buffer;
+}
+
+bool Stream_source::read_frame(stream &s, int cam, Mat &frame)
+{
+    if(s.fd < 0)
+        return false;
+
+    if(s.y4m)
+    {
+        string line;
+        if(!read_line(s.fd, line) || line.compare(0, 5, "FRAME") != 0)
+            return false;
+    }
+
+    if(yuv_output && s.format == PIX_I420)
+    {
+        frame = pooled_buffer(cam, Size(s.size.width, s.size.height * 3 / 2), CV_8UC1);
+        return read_exact(s.fd, frame.data, frame.total());
+    }
+
+    Size out_size = s.size;
+    if(decode_scales[cam] < 1.0 - 1e-6)
+        out_size = Size(cvRound(s.size.width * decode_scales[cam]), cvRound(s.size.height * decode_scales[cam]));
+
+    // BGR at full size needs no conversion, read it into the frame buffer itself
+    if(s.format == PIX_BGR24 && out_size == s.size)
+    {
+        frame = pooled_buffer(cam, s.size, CV_8UC3);
+        return read_exact(s.fd, frame.data, frame.total() * frame.elemSize());
+    }
+
+    if(s.format == PIX_BGR24)
+        s.raw.create(s.size, CV_8UC3);
+    else if(s.format == PIX_I420)
+        s.raw.create(s.size.height * 3 / 2, s.size.width, CV_8UC1);
+    else
+        s.raw.create(s.size, CV_8UC1);
+    if(!read_exact(s.fd, s.raw.data, s.raw.total() * s.raw.elemSize()))
+        return false;
+
+    if(out_size == s.size)
+    {
+        frame = pooled_buffer(cam, s.size, CV_8UC3);
+        if(s.format == PIX_I420)
+            cvtColor(s.raw, frame, COLOR_YUV2BGR_I420);
+        else
+            cvtColor(s.raw, frame, COLOR_GRAY2BGR);
+        return true;
+    }
+
+    // reduced, convert into the stream's scratch image and downscale from there into the frame buffer
+    Mat bgr = s.raw;
+    if(s.format == PIX_I420)
+    {
+        cvtColor(s.raw, s.bgr, COLOR_YUV2BGR_I420);
+        bgr = s.bgr;
+    }
+    else if(s.format == PIX_GRAY)
+    {
+        cvtColor(s.raw, s.bgr, COLOR_GRAY2BGR);
+        bgr = s.bgr;
+    }
+
+    frame = pooled_buffer(cam, out_size, CV_8UC3);
+    resize(bgr, frame, out_size, 0, 0, INTER_AREA);
+    return true;
+}
+
+bool Stream_source::set_yuv_output(bool enable)
+{
+    yuv_output = enable;
+    for(int i = 0; enable && i < streams.size(); i++)
+    {
+        if(streams[i].format != PIX_I420)
+            return false;
+    }
+    return true;
+}
+
+void Stream_source::set_decode_scale(const vector<double> &scales)
+{
+    for(int i = 0; i < decode_scales.size() && i < scales.size(); i++)
+        decode_scales[i] = min(1.0, scales[i]);
+}
+
+vector<Size> Stream_source::full_sizes()
+{
+    vector<Size> sizes;
+    for(int i = 0; i < num_cameras; i++)
+        sizes.push_back(interleaved ? streams[0].size : streams[i].size);
+    return sizes;
+}
+
+bool Stream_source::read(vector<Mat> &frames)
+{
+    frames.resize(num_cameras);
+    for(int i = 0; i < num_cameras; i++)
+    {
+        // drop the previous frame first so its buffer counts as free
+        frames[i].release();
+        if(!read_frame(interleaved ? streams[0] : streams[i], i, frames[i]))
+            return false;
+    }
+    return true;
+}
+
+Shm_source::Shm_source(const string &name, int open_timeout_ms)
+{
+    desc = NULL;
+    data = NULL;
+
+    // the producer may still be setting the ring up
+    bool opened = false;
+    for(int waited = 0; !opened && waited <= open_timeout_ms; waited += 10)
+    {
+        opened = ring.open(name);
+        if(!opened)
+            usleep(10000);
+    }
+    if(!opened)
+        STICHER_DBG_ERR("can not open shared memory ring " << name);
+}
+
+vector<Size> Shm_source::full_sizes()
+{
+    // the sizes travel with the frames, so peek at the first group and keep it for read()
+    if(sizes.empty())
+    {
+        if(!data)
+            data = ring.wait_dequeue(desc);
+        for(int i = 0; data && i < desc->num_images; i++)
+            sizes.push_back(Size(desc->images[i].cols, desc->images[i].rows));
+    }
+
+    return sizes;
+}
+
+void Shm_source::set_decode_scale(const vector<double> &scales)
+{
+    decode_scales = scales;
+}
+
+bool Shm_source::read(vector<Mat> &frames)
+{
+    if(!data)
+        data = ring.wait_dequeue(desc);
+    if(!data)
+    {
+        // a producer that died without publishing the end of the stream ends it here
+        if(!ring.finished() && ring.peer_gone())
+            STICHER_DBG_ERR("shared memory producer is gone");
+        return false;
+    }
+
+    frames.resize(desc->num_images);
+    for(int i = 0; i < desc->num_images; i++)
+    {
+        const shm_image_desc &img = desc->images[i];
+        Mat slot_img(img.rows, img.cols, img.type, data + img.offset, img.step);
+
+        double scale = (i < decode_scales.size()) ? decode_scales[i] : 1.0;
+        frames[i] = Mat();
+        if(scale < 1.0 - 1e-6)
+            resize(slot_img, frames[i], Size(), scale, scale, INTER_AREA);
+        else
+            slot_img.copyTo(frames[i]);
+    }
+
+    ring.release();
+    data = NULL;
+    return true;
+}
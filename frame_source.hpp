@@ -0,0 +1,212 @@
+#ifndef FRAME_SOURCE_HPP
+#define FRAME_SOURCE_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/videoio.hpp"
+#include "atomicops.h"
+#include "readerwriterqueue.h"
+#include "shm_ring.hpp"
+
+// Reads and decodes image sets ahead of their use. File reads and decodes run on a pool of threads, at most
+// depth sets are in flight or waiting to be taken (bounding memory), and next() hands sets out in index order
+// whatever order their files finish in. list(idx, files) names the files of set idx, false ends the sequence.
+class Image_loader
+{
+    public:
+    typedef std::function<bool(int idx, std::vector<std::string> &files)> set_list;
+
+    struct loaded_set
+    {
+        int idx;
+        std::vector<cv::Mat> imgs;
+        std::string error;
+        double load_ms;     // read and decode time summed over the set's files
+    };
+
+    Image_loader(set_list list_, int depth_ = 4, int num_threads_ = 4);
+    ~Image_loader();
+
+    // imread flags per position in a set, IMREAD_COLOR for positions not given. Only before the first next().
+    void                                    set_decode_flags        (const std::vector<int> &flags);
+    bool                                    next                    (loaded_set &set);
+
+    private:
+    struct pending_set
+    {
+        loaded_set loaded;
+        std::vector<std::string> files;
+        int remaining;
+    };
+
+    bool                                    schedule                ();
+    void                                    decode_thread           ();
+
+    set_list list;
+    int depth;
+    int num_threads;
+    std::vector<int> decode_flags;
+    std::vector<std::thread> decoders;
+    std::deque<pending_set> window;
+    std::queue<std::pair<int, int> > jobs;
+    int first_index;
+    int next_index;
+    bool started;
+    bool ended;
+    bool stop;
+    std::mutex lock;
+    std::condition_variable job_ready;
+    std::condition_variable set_ready;
+};
+
+// One frame group (one image per camera) per read(). set_decode_scale tells the source the smallest
+// fraction of the full resolution the consumer needs (see Basic_stitcher::required_input_scale),
+// so it may decode or downscale before handing the frames out.
+class Frame_source
+{
+    public:
+    virtual ~Frame_source() {}
+
+    virtual std::vector<cv::Size>           full_sizes              () = 0;
+    virtual void                            set_decode_scale        (const std::vector<double> &scales) = 0;
+    virtual bool                            read                    (std::vector<cv::Mat> &frames) = 0;
+};
+
+// Still image sequences, one printf style pattern per camera ("cam0/%06d.jpg").
+// JPEG files are decoded with libjpeg DCT scaling (IMREAD_REDUCED_COLOR_2/4/8), picking the strongest
+// reduction that still keeps at least the requested scale. Groups are read ahead by an Image_loader.
+class Image_sequence_source : public Frame_source
+{
+    public:
+    Image_sequence_source(const std::vector<std::string> &patterns_, int first_index = 0);
+
+    std::vector<cv::Size>                   full_sizes              ();
+    void                                    set_decode_scale        (const std::vector<double> &scales);
+    bool                                    read                    (std::vector<cv::Mat> &frames);
+
+    static int                              reduced_decode_flag     (double scale);
+
+    private:
+    std::string                             file_name               (int cam, int index);
+
+    std::vector<std::string> patterns;
+    std::vector<cv::Size> sizes;
+    std::vector<int> decode_flags;
+    int index;
+    cv::Ptr<Image_loader> loader;
+};
+
+// Video files, decoded on a dedicated thread, starting at first_frame. Frames are downscaled to the requested
+// scale on the same thread right after decode, so the consumer only ever sees the reduced frames.
+class Video_source : public Frame_source
+{
+    public:
+    Video_source(const std::vector<std::string> &files, int queue_depth = 4, int first_frame = 0);
+    ~Video_source();
+
+    std::vector<cv::Size>                   full_sizes              ();
+    void                                    set_decode_scale        (const std::vector<double> &scales);
+    bool                                    read                    (std::vector<cv::Mat> &frames);
+
+    private:
+    void                                    decode_thread           ();
+
+    std::vector<cv::VideoCapture> captures;
+    std::vector<cv::Size> sizes;
+    std::vector<double> decode_scales;
+    std::atomic<bool> started;
+    std::atomic<bool> stop;
+    bool finished;
+    std::thread decoder;
+    moodycamel::BlockingReaderWriterQueue<std::vector<cv::Mat> > ready;
+    moodycamel::BlockingReaderWriterQueue<int> free_slots;
+    int queue_depth;
+};
+
+// Raw or Y4M frames from pipes: stdin ("-"), FIFOs or files, or Unix stream sockets ("unix:/path"). Either one
+// stream per camera, or a single stream carrying interleaved_cameras frames per group back to back. Y4M headers
+// are parsed once when the source is created (C420* and Cmono), raw streams need frame_size and format.
+// Pixel data is read with large read() calls straight into pooled buffers; a buffer is reused once the
+// consumer dropped its last reference to the frame handed out in it.
+class Stream_source : public Frame_source
+{
+    public:
+    enum pixel_format
+    {
+        PIX_BGR24,
+        PIX_I420,
+        PIX_GRAY
+    };
+
+    Stream_source(const std::vector<std::string> &paths, int interleaved_cameras = 0);
+    Stream_source(const std::vector<std::string> &paths, cv::Size frame_size, pixel_format format
+                    , int interleaved_cameras = 0);
+    ~Stream_source();
+
+    std::vector<cv::Size>                   full_sizes              ();
+    void                                    set_decode_scale        (const std::vector<double> &scales);
+    bool                                    read                    (std::vector<cv::Mat> &frames);
+    // Hand I420 streams out as they are (CV_8UC1, rows * 3 / 2) for Basic_stitcher::stitcher_do_frame_yuv,
+    // without BGR conversion or decode scaling. False when a stream is not 4:2:0.
+    bool                                    set_yuv_output          (bool enable);
+
+    static int                              open_stream             (const std::string &path, bool for_write);
+    static bool                             read_exact              (int fd, void *data, size_t size);
+
+    private:
+    struct stream
+    {
+        int fd;
+        bool y4m;
+        cv::Size size;
+        pixel_format format;
+        cv::Mat raw;
+        cv::Mat bgr;
+    };
+
+    void                                    open_streams            (const std::vector<std::string> &paths, int interleaved_cameras);
+    bool                                    read_line               (int fd, std::string &line);
+    bool                                    read_y4m_header         (stream &s);
+    bool                                    read_frame              (stream &s, int cam, cv::Mat &frame);
+    cv::Mat                                 pooled_buffer           (int cam, cv::Size size, int type);
+
+    std::vector<stream> streams;
+    int num_cameras;
+    bool interleaved;
+    bool yuv_output;
+    std::vector<double> decode_scales;
+    std::vector<std::vector<cv::Mat> > pools;
+    int pool_size;
+};
+
+// Frame groups from a Shm_ring filled by a producer process (main --shm_produce). Every group is copied out of
+// its slot, downscaled on the way when a decode scale is set, and the slot is released right away, so frames
+// handed to the stitcher threads never point into shared memory.
+class Shm_source : public Frame_source
+{
+    public:
+    Shm_source(const std::string &name, int open_timeout_ms = 10000);
+
+    std::vector<cv::Size>                   full_sizes              ();
+    void                                    set_decode_scale        (const std::vector<double> &scales);
+    bool                                    read                    (std::vector<cv::Mat> &frames);
+
+    private:
+    Shm_ring ring;
+    const shm_group_desc* desc;
+    unsigned char* data;
+    std::vector<cv::Size> sizes;
+    std::vector<double> decode_scales;
+};
+
+#endif
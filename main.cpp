@@ -1,7 +1,13 @@
 #include "stitcher.hpp"
+#include "frame_source.hpp"
+#include "batch.hpp"
+#include "frame_sink.hpp"
+#include "shard.hpp"
 
 #include <thread>
 #include <future>
+#include <atomic>
+#include <csignal>
 #include "atomicops.h"
 #include "readerwriterqueue.h"
 
@@ -10,11 +16,17 @@ using namespace cv;
 using namespace moodycamel;
 
 #define QUEUE_SIZE 500
+#define REORDER_WINDOW 8
 
 class thread_args
 {
     public :
+    thread_args() { stop = false; calib_version = 0; }
+
     vector<Mat> imgs;
+    bool stop;          // no more frames, the stitcher thread returns
+    Ptr<vector<detail::CameraParams> > cameras;     // shared calibration, applied when calib_version is new
+    int calib_version;
 };
 
 class thread_output
@@ -23,6 +35,27 @@ class thread_output
     Mat pano;
 };
 
+// pipeline choices given as "--name value" on the command line, see Basic_stitcher::set_option
+vector<pair<string, string> > stitcher_options;
+
+// calibration bundle given with --calib, shared by all stitchers instead of calibrating on the first frame
+string calibration_file;
+
+// --yuv on: I420 frames through Basic_stitcher::stitcher_do_frame_yuv instead of BGR
+bool yuv_path = false;
+
+// stitcher threads frames are spread over, round robin. Temporal seams follow the previous frame of their own
+// stitcher, so "--seam temporal" keeps every frame on one thread.
+int stitcher_threads = 4;
+
+void apply_stitcher_options(Basic_stitcher &stitcher)
+{
+    for(int i = 0; i < stitcher_options.size(); i++)
+        stitcher.set_option(stitcher_options[i].first, stitcher_options[i].second);
+    if(!calibration_file.empty())
+        stitcher.load_camera_params(calibration_file);
+}
+
 BlockingReaderWriterQueue<thread_args> th_arg0(QUEUE_SIZE);
 BlockingReaderWriterQueue<thread_args> th_arg1(QUEUE_SIZE);
 BlockingReaderWriterQueue<thread_args> th_arg2(QUEUE_SIZE);
@@ -33,8 +66,22 @@ BlockingReaderWriterQueue<thread_output> th_out1(QUEUE_SIZE);
 BlockingReaderWriterQueue<thread_output> th_out2(QUEUE_SIZE);
 BlockingReaderWriterQueue<thread_output> th_out3(QUEUE_SIZE);
 
+// set by a stitcher thread that detected calibration drift, the main thread then recalibrates for all of them
+atomic<bool> drift_detected(false);
+
 void stitcher_thread(int idx)
 {
+    // One stitcher per thread, all composing with the calibration made on the main thread, so consecutive
+    // frames never switch cameras. A thread that detects drift does not recalibrate by itself, it asks the
+    // main thread and keeps the shared cameras until new ones arrive with a frame.
+    Basic_stitcher stitcher(false);
+    apply_stitcher_options(stitcher);
+    // a shared calibration file must stay fixed, every shard composes with the same cameras
+    if(calibration_file.empty())
+        stitcher.set_drift_check(1);
+    int calib_version = -1;
+    int reported_version = -1;
+
     while(true)
     {
         thread_args th_arg;
@@ -57,10 +104,29 @@ void stitcher_thread(int idx)
             th_arg3.wait_dequeue(th_arg);
             break;
         }
+        if(th_arg.stop)
+            return;
+
+        if(th_arg.calib_version != calib_version)
+        {
+            vector<detail::CameraParams> cameras = *th_arg.cameras;
+            stitcher.set_camera_params(cameras);
+            calib_version = th_arg.calib_version;
+        }
 
         thread_output th_out;
-        Basic_stitcher stitcher(false);
-        th_out.pano =stitcher.stitcher_do_all(th_arg.imgs);
+        th_out.pano = yuv_path ? stitcher.stitcher_do_frame_yuv(th_arg.imgs) : stitcher.stitcher_do_frame(th_arg.imgs);
+
+        // the baseline stays the one of the shared cameras until new ones arrive, drift is reported once per calibration
+        if(stitcher.need_recalibration())
+        {
+            stitcher.cancel_recalibration();
+            if(reported_version != calib_version)
+            {
+                drift_detected = true;
+                reported_version = calib_version;
+            }
+        }
         
         switch(idx)
         {
@@ -83,104 +149,616 @@ void stitcher_thread(int idx)
     }
 }
 
+void put_frame(int idx, const thread_args &th_arg)
+{
+    switch(idx)
+    {
+        case 0:
+        th_arg0.enqueue(th_arg);
+        break;
+
+        case 1:
+        th_arg1.enqueue(th_arg);
+        break;
+
+        case 2:
+        th_arg2.enqueue(th_arg);
+        break;
+
+        case 3:
+        th_arg3.enqueue(th_arg);
+        break;
+    }
+}
+
+// Deep copy of the calibration of stitcher, handed to every stitcher thread
+Ptr<vector<detail::CameraParams> > share_cameras(Basic_stitcher &stitcher)
+{
+    vector<detail::CameraParams> cameras = stitcher.get_camera_params();
+    Ptr<vector<detail::CameraParams> > shared = makePtr<vector<detail::CameraParams> >(cameras);
+    for(int i = 0; i < shared->size(); i++)
+    {
+        (*shared)[i].R = cameras[i].R.clone();
+        (*shared)[i].t = cameras[i].t.clone();
+    }
+    return shared;
+}
+
+// Output of stitcher thread idx. Without wait, returns false when it has none ready.
+bool get_output(int idx, thread_output &th_out, bool wait)
+{
+    switch(idx)
+    {
+        case 0:
+        if(!wait)
+            return th_out0.try_dequeue(th_out);
+        th_out0.wait_dequeue(th_out);
+        return true;
+
+        case 1:
+        if(!wait)
+            return th_out1.try_dequeue(th_out);
+        th_out1.wait_dequeue(th_out);
+        return true;
+
+        case 2:
+        if(!wait)
+            return th_out2.try_dequeue(th_out);
+        th_out2.wait_dequeue(th_out);
+        return true;
+
+        case 3:
+        if(!wait)
+            return th_out3.try_dequeue(th_out);
+        th_out3.wait_dequeue(th_out);
+        return true;
+    }
+    return false;
+}
+
+// Writes one panorama to the output stream, or shows it when there is none
+bool write_output(Ptr<Stream_sink> sink, const Mat &pano, int idx)
+{
+    if(sink)
+    {
+        if(!(yuv_path ? sink->write_yuv(pano) : sink->write(pano)))
+        {
+            STICHER_DBG_ERR("can not write output frame " << idx);
+            return false;
+        }
+        return true;
+    }
+
+    Mat result;
+    if(yuv_path)
+        cvtColor(pano, result, COLOR_YUV2BGR_I420);
+    else
+        pano.convertTo(result, CV_8UC1);
+    imshow("stitch output", result);
+    waitKey(0);
+    return true;
+}
+
+// Producer side of the shared memory transport: decodes with the selected source and publishes every frame
+// group into a Shm_ring, sized after the first group, for a stitcher process started with --shm_consume
+int run_shm_producer(Frame_source &source, const string &name, int num_slots)
+{
+    Shm_ring ring;
+    vector<Mat> imgs;
+    for(int64 sequence = 0; source.read(imgs); sequence++)
+    {
+        if(imgs.size() > SHM_RING_MAX_IMAGES)
+        {
+            STICHER_DBG_ERR("too many cameras for the shared memory ring");
+            return -1;
+        }
+
+        size_t bytes = 0;
+        for(int i = 0; i < imgs.size(); i++)
+            bytes += (imgs[i].cols * imgs[i].elemSize() + 63) / 64 * 64 * imgs[i].rows;
+
+        if(sequence == 0 && !ring.create(name, num_slots, bytes))
+        {
+            STICHER_DBG_ERR("can not create shared memory ring " << name);
+            return -1;
+        }
+        if(bytes > ring.slot_bytes())
+        {
+            STICHER_DBG_ERR("frame group " << sequence << " does not fit the ring slots");
+            return -1;
+        }
+
+        shm_group_desc* desc;
+        unsigned char* slot = ring.wait_enqueue_slot(desc);
+        if(!slot)
+        {
+            // a consumer that took the frames it wanted and closed is not an error
+            if(ring.peer_detached())
+            {
+                STICHER_DBG_OUT("consumer closed the ring, producer done");
+                return 0;
+            }
+            STICHER_DBG_ERR("shared memory consumer is gone");
+            return -1;
+        }
+
+        size_t offset = 0;
+        desc->num_images = imgs.size();
+        for(int i = 0; i < imgs.size(); i++)
+        {
+            shm_image_desc &img = desc->images[i];
+            img.rows = imgs[i].rows;
+            img.cols = imgs[i].cols;
+            img.type = imgs[i].type();
+            img.elem_size = imgs[i].elemSize();
+            img.step = (imgs[i].cols * imgs[i].elemSize() + 63) / 64 * 64;
+            img.offset = offset;
+            imgs[i].copyTo(Mat(img.rows, img.cols, img.type, slot + offset, img.step));
+            offset += img.step * img.rows;
+        }
+        ring.enqueue();
+    }
+
+    ring.finish();
+    if(!ring.wait_drained())
+    {
+        STICHER_DBG_ERR("shared memory consumer is gone before the end of the stream");
+        return -1;
+    }
+    STICHER_DBG_OUT("producer done");
+    return 0;
+}
+
+vector<string> split_list(const string &list)
+{
+    vector<string> items;
+    size_t start = 0;
+    while(start <= list.size())
+    {
+        size_t end = list.find(',', start);
+        if(end == string::npos)
+            end = list.size();
+        if(end > start)
+            items.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+    return items;
+}
+
 int main(int argc, char* argv[])
 {
-    STICHER_DBG_OUT("start");
-    VideoCapture vid0("videofile0.avi");
-    VideoCapture vid1("videofile1.avi");
-    VideoCapture vid2("videofile2.avi");
+    vector<string> video_files;
+    video_files.push_back("videofile0.avi");
+    video_files.push_back("videofile1.avi");
+    video_files.push_back("videofile2.avi");
+    vector<string> image_patterns;
+    vector<string> stream_paths;
+    string stream_format = "y4m";
+    Size stream_size;
+    int stream_interleaved = 0;
+    string shm_produce;
+    string shm_consume;
+    int shm_slots = 4;
+    int num_shards = 0;
+    string shard_dir = ".";
+    int num_frames = 0;
+    int first_frame = 0;
+    int max_frames = -1;            // frames after the first one, -1 reads until the source ends
+    vector<string> worker_args;
+    string output_path;
+    string output_format = "y4m";
+    string tiled_list;
+    string tiles_out = ".";
+    int tile_size = 512;
+    string pyramid;
+    string batch_manifest;
+    string batch_out = ".";
+    string batch_report = "batch_report.tsv";
+    int batch_workers = 4;
+    int batch_prefetch = 8;
 
-    vector<Mat> output;
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        string name = argv[i];
+        if(name.compare(0, 2, "--") != 0)
+        {
+            STICHER_DBG_ERR("unknown argument " << name);
+            return -1;
+        }
+        if(name == "--yuv")
+        {
+            yuv_path = (string(argv[i + 1]) == "on");
+            worker_args.push_back(name);
+            worker_args.push_back(argv[i + 1]);
+            continue;
+        }
+        if(name == "--shard")
+        {
+            num_shards = atoi(argv[i + 1]);
+            continue;
+        }
+        if(name == "--shard_dir")
+        {
+            shard_dir = argv[i + 1];
+            continue;
+        }
+        if(name == "--frames")
+        {
+            num_frames = atoi(argv[i + 1]);
+            continue;
+        }
+        if(name == "--calib")
+        {
+            calibration_file = argv[i + 1];
+            continue;
+        }
+        if(name == "--frame_range")
+        {
+            sscanf(argv[i + 1], "%d:%d", &first_frame, &max_frames);
+            max_frames = max(max_frames - 1, 0);
+            continue;
+        }
+        // everything but the sharding and output arguments is passed on to shard workers
+        if(name != "--output" && name != "--output_format")
+        {
+            worker_args.push_back(name);
+            worker_args.push_back(argv[i + 1]);
+        }
+        if(name == "--videos")
+        {
+            video_files = split_list(argv[i + 1]);
+            continue;
+        }
+        if(name == "--images")
+        {
+            image_patterns = split_list(argv[i + 1]);
+            continue;
+        }
+        if(name == "--stream")
+        {
+            stream_paths = split_list(argv[i + 1]);
+            continue;
+        }
+        if(name == "--stream_format")
+        {
+            stream_format = argv[i + 1];
+            continue;
+        }
+        if(name == "--stream_size")
+        {
+            sscanf(argv[i + 1], "%dx%d", &stream_size.width, &stream_size.height);
+            continue;
+        }
+        if(name == "--stream_interleaved")
+        {
+            stream_interleaved = atoi(argv[i + 1]);
+            continue;
+        }
+        if(name == "--shm_produce")
+        {
+            shm_produce = argv[i + 1];
+            continue;
+        }
+        if(name == "--shm_consume")
+        {
+            shm_consume = argv[i + 1];
+            continue;
+        }
+        if(name == "--shm_slots")
+        {
+            shm_slots = atoi(argv[i + 1]);
+            continue;
+        }
+        if(name == "--output")
+        {
+            output_path = argv[i + 1];
+            continue;
+        }
+        if(name == "--output_format")
+        {
+            output_format = argv[i + 1];
+            if(output_format != "y4m" && output_format != "bgr24" && output_format != "i420")
+            {
+                STICHER_DBG_ERR("bad option " << name << " " << output_format);
+                return -1;
+            }
+            continue;
+        }
+        if(name == "--tiled")
+        {
+            tiled_list = argv[i + 1];
+            continue;
+        }
+        if(name == "--tiles_out")
+        {
+            tiles_out = argv[i + 1];
+            continue;
+        }
+        if(name == "--pyramid")
+        {
+            pyramid = argv[i + 1];
+            if(pyramid != "dzi" && pyramid != "xyz")
+            {
+                STICHER_DBG_ERR("bad option " << name << " " << pyramid);
+                return -1;
+            }
+            continue;
+        }
+        if(name == "--batch")
+        {
+            batch_manifest = argv[i + 1];
+            continue;
+        }
+        if(name == "--batch_out")
+        {
+            batch_out = argv[i + 1];
+            continue;
+        }
+        if(name == "--batch_report")
+        {
+            batch_report = argv[i + 1];
+            continue;
+        }
+        if(name == "--batch_workers")
+        {
+            batch_workers = atoi(argv[i + 1]);
+            continue;
+        }
+        if(name == "--batch_prefetch")
+        {
+            batch_prefetch = atoi(argv[i + 1]);
+            continue;
+        }
+        if(name == "--tile_size")
+        {
+            tile_size = atoi(argv[i + 1]);
+            continue;
+        }
+        stitcher_options.push_back(make_pair(name.substr(2), string(argv[i + 1])));
 
-    thread thread0(stitcher_thread, 0);
-    thread thread1(stitcher_thread, 1);
-    thread thread2(stitcher_thread, 2);
-    thread thread3(stitcher_thread, 3);
-    
+        Basic_stitcher probe(false);
+        if(!probe.set_option(stitcher_options.back().first, stitcher_options.back().second))
+        {
+            STICHER_DBG_ERR("bad option " << name << " " << argv[i + 1]);
+            return -1;
+        }
+        if(stitcher_options.back().first == "seam")
+            stitcher_threads = stitcher_options.back().second == "temporal" ? 1 : 4;
+    }
+
+    if(!batch_manifest.empty())
     {
-        vector<Mat> vids(3);
-        vid0 >> vids[0];
-        vid1 >> vids[1];
-        vid2 >> vids[2];
+        Batch_stitcher batch(stitcher_options, batch_workers, batch_prefetch);
+        if(!batch.load_manifest(batch_manifest) || !batch.run(batch_out, batch_report))
+            return -1;
+
+        STICHER_DBG_OUT("stitching completed successfully\n");
+        return 0;
+    }
+
+    if(!tiled_list.empty())
+    {
+        // one still panorama from the image files listed one per line, written as tiles
+        vector<string> files;
+        ifstream list(tiled_list.c_str());
+        string line;
+        while(getline(list, line))
+        {
+            if(!line.empty())
+                files.push_back(line);
+        }
 
-        STICHER_DBG_OUT("start stitching first frame");
         Basic_stitcher stitcher(false);
-        Mat pano = stitcher.stitcher_do_all(vids);
-        STICHER_DBG_OUT("push to output queue");
-        output.push_back(pano);
+        apply_stitcher_options(stitcher);
+        Ptr<Tile_sink> sink;
+        if(pyramid == "dzi")
+            sink = makePtr<Pyramid_tile_sink>(tiles_out, Pyramid_tile_sink::LAYOUT_DZI);
+        else if(pyramid == "xyz")
+            sink = makePtr<Pyramid_tile_sink>(tiles_out, Pyramid_tile_sink::LAYOUT_XYZ);
+        else
+            sink = makePtr<Raw_tile_sink>(tiles_out);
+
+        if(!stitcher.stitch_tiled(files, *sink, tile_size))
+        {
+            STICHER_DBG_ERR("tiled stitching failed");
+            return -1;
+        }
+
+        STICHER_DBG_OUT("stitching completed successfully\n");
+        return 0;
     }
 
-    int capture_count = 0;
-    while(capture_count < 12)
+    Ptr<Stream_sink> sink;
+    if(!output_path.empty())
     {
-        STICHER_DBG_OUT("Put frame");
-        
-        vector<Mat> vids(3);
-        
-        thread_args th_arg;
-        Mat tmp;
-        vid0 >> tmp;
-        th_arg.imgs.push_back(tmp.clone());
-        vid1 >> tmp;
-        th_arg.imgs.push_back(tmp.clone());
-        vid2 >> tmp;
-        th_arg.imgs.push_back(tmp.clone());
+        // frames own stdout now, log messages go to stderr
+        if(output_path == "-")
+            cout.rdbuf(cerr.rdbuf());
+        signal(SIGPIPE, SIG_IGN);
 
-        switch(capture_count % 4)
+        Stream_sink::output_format format = Stream_sink::OUT_Y4M;
+        if(output_format == "bgr24")
+            format = Stream_sink::OUT_BGR24;
+        else if(output_format == "i420")
+            format = Stream_sink::OUT_I420;
+        sink = makePtr<Stream_sink>(output_path, format);
+    }
+    STICHER_DBG_OUT("start");
+
+    Ptr<Frame_source> source;
+    if(yuv_path && (stream_paths.empty() || (stream_format != "y4m" && stream_format != "i420")))
+    {
+        STICHER_DBG_ERR("--yuv on needs an i420 or y4m --stream input");
+        return -1;
+    }
+
+    if(!shm_consume.empty())
+        source = makePtr<Shm_source>(shm_consume);
+    else if(!stream_paths.empty())
+    {
+        Ptr<Stream_source> stream;
+        if(stream_format == "y4m")
+            stream = makePtr<Stream_source>(stream_paths, stream_interleaved);
+        else if(stream_format == "bgr24")
+            stream = makePtr<Stream_source>(stream_paths, stream_size, Stream_source::PIX_BGR24, stream_interleaved);
+        else if(stream_format == "i420")
+            stream = makePtr<Stream_source>(stream_paths, stream_size, Stream_source::PIX_I420, stream_interleaved);
+        else if(stream_format == "gray")
+            stream = makePtr<Stream_source>(stream_paths, stream_size, Stream_source::PIX_GRAY, stream_interleaved);
+        else
         {
-            case 0:
-            th_arg0.enqueue(th_arg);
-            break;
+            STICHER_DBG_ERR("bad option --stream_format " << stream_format);
+            return -1;
+        }
+        if(!stream->set_yuv_output(yuv_path))
+        {
+            STICHER_DBG_ERR("--yuv on needs 4:2:0 streams");
+            return -1;
+        }
+        source = stream;
+    }
+    else if(!image_patterns.empty())
+        source = makePtr<Image_sequence_source>(image_patterns, first_frame);
+    else
+        source = makePtr<Video_source>(video_files, 4, first_frame);
 
-            case 1:
-            th_arg1.enqueue(th_arg);
-            break;
-            
-            case 2:
-            th_arg2.enqueue(th_arg);
-            break;
-            
-            case 3:
-            th_arg3.enqueue(th_arg);
-            break;
+    {
+        // decode no larger than the biggest of the work, seam and compose resolutions
+        Basic_stitcher probe(false);
+        apply_stitcher_options(probe);
+        vector<Size> sizes = source->full_sizes();
+        vector<double> scales;
+        for(int i = 0; i < sizes.size(); i++)
+            scales.push_back(probe.required_input_scale(sizes[i]));
+        source->set_decode_scale(scales);
+    }
+
+    if(!shm_produce.empty())
+        return run_shm_producer(*source, shm_produce, shm_slots);
+
+    if(num_shards > 0)
+    {
+        // calibrate once here, then let the workers compose their frame ranges with that bundle
+        if(!stream_paths.empty() || !shm_consume.empty())
+        {
+            STICHER_DBG_ERR("sharding needs seekable video or image inputs");
+            return -1;
+        }
+        if(num_frames <= 0 && image_patterns.empty())
+            num_frames = (int)VideoCapture(video_files[0]).get(CAP_PROP_FRAME_COUNT);
+        if(num_frames <= 0)
+        {
+            STICHER_DBG_ERR("unknown frame count, give --frames");
+            return -1;
         }
 
-        capture_count++;
+        vector<Mat> vids;
+        if(!source->read(vids))
+        {
+            STICHER_DBG_ERR("can not read first frame");
+            return -1;
+        }
+
+        Basic_stitcher stitcher(false);
+        apply_stitcher_options(stitcher);
+        stitcher.update_image_scale(vids);
+        stitcher.calculate_camera_params(vids);
+        string calib = shard_dir + "/calib.yml";
+        if(!stitcher.save_camera_params(calib))
+            return -1;
+
+        Shard_coordinator coordinator(worker_args, num_shards, shard_dir);
+        if(!coordinator.run(num_frames, calib, output_path.empty() ? "pano.y4m" : output_path))
+            return -1;
+
+        STICHER_DBG_OUT("stitching completed successfully\n");
+        return 0;
     }
 
-    for(int i = 0; i < capture_count; i++)
+    // the main thread stitches the first frame and owns the calibration every stitcher thread uses
+    Basic_stitcher calibration(false);
+    apply_stitcher_options(calibration);
+    Ptr<vector<detail::CameraParams> > cameras;
+    int calib_version = 0;
     {
-        thread_output th_out;
-        switch(i % 4)
+        vector<Mat> vids;
+        if(!source->read(vids))
         {
-            case 0:
-            th_out0.wait_dequeue(th_out);
-            break;
+            STICHER_DBG_ERR("can not read first frame");
+            return -1;
+        }
 
-            case 1:
-            th_out1.wait_dequeue(th_out);
-            break;
-            
-            case 2:
-            th_out2.wait_dequeue(th_out);
-            break;
-            
-            case 3:
-            th_out3.wait_dequeue(th_out);
+        STICHER_DBG_OUT("start stitching first frame");
+        Mat pano;
+        if(yuv_path)
+            pano = calibration.stitcher_do_frame_yuv(vids);
+        else
+            pano = calibration_file.empty() ? calibration.stitcher_do_all(vids) : calibration.stitcher_do_frame(vids);
+        cameras = share_cameras(calibration);
+
+        if(!write_output(sink, pano, 0))
+            return -1;
+    }
+
+    thread thread0(stitcher_thread, 0);
+    thread thread1(stitcher_thread, 1);
+    thread thread2(stitcher_thread, 2);
+    thread thread3(stitcher_thread, 3);
+
+    // Frames are written in capture order as soon as they are stitched. At most REORDER_WINDOW frames are in
+    // flight, reading waits for the oldest one beyond that, so memory stays bounded on endless streams.
+    bool ok = true;
+    int capture_count = 0;
+    int written = 0;
+    while(ok && (max_frames < 0 || capture_count < max_frames))
+    {
+        STICHER_DBG_OUT("Put frame");
+
+        thread_args th_arg;
+        if(!source->read(th_arg.imgs))
             break;
+
+        if(drift_detected.exchange(false))
+        {
+            STICHER_DBG_OUT("----Recalibrating for all stitcher threads----");
+            calibration.recalibrate(th_arg.imgs, yuv_path);
+            cameras = share_cameras(calibration);
+            calib_version++;
         }
+        th_arg.cameras = cameras;
+        th_arg.calib_version = calib_version;
+        put_frame(capture_count % stitcher_threads, th_arg);
+        capture_count++;
 
-        output.push_back(th_out.pano);
+        while(ok && written < capture_count)
+        {
+            thread_output th_out;
+            if(!get_output(written % stitcher_threads, th_out, capture_count - written >= REORDER_WINDOW))
+                break;
+            ok = write_output(sink, th_out.pano, ++written);
+        }
     }
 
-    for(int i = 0; i < output.size(); i++)
+    while(ok && written < capture_count)
     {
-        Mat result;
-        output[i].convertTo(result, CV_8UC1);
-        imshow("stitch output", result);
-        waitKey(0);
+        thread_output th_out;
+        get_output(written % stitcher_threads, th_out, true);
+        ok = write_output(sink, th_out.pano, ++written);
     }
 
+    // every stitcher thread must be joined before main returns, a joinable std::thread terminates the process
+    thread_args stop_arg;
+    stop_arg.stop = true;
+    for(int i = 0; i < 4; i++)
+        put_frame(i, stop_arg);
+    thread0.join();
+    thread1.join();
+    thread2.join();
+    thread3.join();
+
+    if(!ok)
+        return -1;
+
     STICHER_DBG_OUT("stitching completed successfully\n");
     return 0;
-}
\ No newline at end of file
+}
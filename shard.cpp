@@ -0,0 +1,123 @@
+#include "shard.hpp"
+#include "frame_source.hpp"
+#include "frame_sink.hpp"
+#include "stitcher.hpp"
+
+#include <cstdio>
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+using namespace std;
+using namespace cv;
+
+Shard_coordinator::Shard_coordinator(const vector<string> &worker_args_, int num_shards_, const string &work_dir_)
+{
+    worker_args = worker_args_;
+    num_shards = max(1, num_shards_);
+    work_dir = work_dir_;
+}
+
+pid_t Shard_coordinator::spawn_worker(int first, int count, const string &calib_file, const string &part)
+{
+    char range[64];
+    snprintf(range, sizeof(range), "%d:%d", first, count);
+
+    vector<string> args = worker_args;
+    args.push_back("--calib");
+    args.push_back(calib_file);
+    args.push_back("--frame_range");
+    args.push_back(range);
+    args.push_back("--output");
+    args.push_back(part);
+    args.push_back("--output_format");
+    args.push_back("y4m");
+
+    vector<char*> argv;
+    argv.push_back((char*)"multi_thread_video_stitcher");
+    for(int i = 0; i < args.size(); i++)
+        argv.push_back((char*)args[i].c_str());
+    argv.push_back(NULL);
+
+    pid_t pid;
+    if(posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv.data(), environ) != 0)
+        return -1;
+    return pid;
+}
+
+bool Shard_coordinator::run(int num_frames, const string &calib_file, const string &output)
+{
+    vector<pid_t> workers;
+    vector<string> parts;
+    int per_shard = (num_frames + num_shards - 1) / num_shards;
+    for(int first = 0; first < num_frames; first += per_shard)
+    {
+        char part[64];
+        snprintf(part, sizeof(part), "/part_%03d.y4m", (int)parts.size());
+        parts.push_back(work_dir + part);
+
+        int count = min(per_shard, num_frames - first);
+        pid_t pid = spawn_worker(first, count, calib_file, parts.back());
+        if(pid < 0)
+            STICHER_DBG_ERR("can not start worker for frames " << first << ".." << first + count - 1);
+        else
+            STICHER_DBG_OUT("worker " << pid << " frames " << first << ".." << first + count - 1);
+        workers.push_back(pid);
+    }
+
+    bool ok = true;
+    for(int i = 0; i < workers.size(); i++)
+    {
+        int status = -1;
+        if(workers[i] < 0 || waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            STICHER_DBG_ERR("worker for " << parts[i] << " failed");
+            ok = false;
+        }
+    }
+    if(!ok)
+        return false;
+
+    return concatenate(parts, output);
+}
+
+bool Shard_coordinator::concatenate(const vector<string> &parts, const string &output)
+{
+    // every part is a complete Y4M stream of the same panorama size, keep the first header only
+    int out = Stream_source::open_stream(output, true);
+    if(out < 0)
+    {
+        STICHER_DBG_ERR("can not open output " << output);
+        return false;
+    }
+
+    vector<char> buffer(1 << 22);
+    bool ok = true;
+    for(int i = 0; i < parts.size() && ok; i++)
+    {
+        int in = open(parts[i].c_str(), O_RDONLY);
+        if(in < 0)
+        {
+            STICHER_DBG_ERR("can not read " << parts[i]);
+            ok = false;
+            break;
+        }
+
+        char c = 0;
+        while(i > 0 && c != '\n' && Stream_source::read_exact(in, &c, 1))
+            ;
+
+        ssize_t n;
+        while(ok && (n = ::read(in, buffer.data(), buffer.size())) > 0)
+            ok = Stream_sink::write_exact(out, buffer.data(), n);
+        close(in);
+        unlink(parts[i].c_str());
+    }
+
+    if(out > STDERR_FILENO)
+        close(out);
+    return ok;
+}
@@ -0,0 +1,31 @@
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// Splits a video job into contiguous frame ranges, one per local worker process. Workers are this executable
+// spawned with worker_args plus "--calib <calib_file> --frame_range <first>:<count> --output <part>", so they
+// all compose with the same calibration bundle, and write Y4M parts into work_dir that are concatenated in
+// frame order into the final output once every worker exited successfully.
+class Shard_coordinator
+{
+    public:
+    Shard_coordinator(const std::vector<std::string> &worker_args_, int num_shards_, const std::string &work_dir_ = ".");
+
+    bool                                    run                     (int num_frames, const std::string &calib_file
+                                                                    , const std::string &output);
+
+    private:
+    pid_t                                   spawn_worker            (int first, int count, const std::string &calib_file
+                                                                    , const std::string &part);
+    bool                                    concatenate             (const std::vector<std::string> &parts
+                                                                    , const std::string &output);
+
+    std::vector<std::string> worker_args;
+    int num_shards;
+    std::string work_dir;
+};
+
+#endif
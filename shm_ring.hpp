@@ -0,0 +1,372 @@
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <cstdint>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_RING_MAGIC      0x53524e47u
+#define SHM_RING_MAX_IMAGES 16
+#define SHM_RING_MAX_SLOTS  64
+
+// Position of one image inside a slot. type is the OpenCV type (CV_8UC3, ...), offset is from the slot start.
+struct shm_image_desc
+{
+    int32_t rows;
+    int32_t cols;
+    int32_t type;
+    int32_t elem_size;
+    uint64_t step;
+    uint64_t offset;
+};
+
+// One frame group. A group with end set closes the stream and carries no images.
+struct shm_group_desc
+{
+    uint64_t sequence;
+    int32_t num_images;
+    int32_t end;
+    shm_image_desc images[SHM_RING_MAX_IMAGES];
+};
+
+// Single producer / single consumer ring of frame group slots in POSIX shared memory, for passing frames between
+// two processes without copying them through a pipe. Same semantics as moodycamel::BlockingReaderWriterQueue,
+// except that an element is a slot that is filled or read in place: the producer gets a free slot with
+// wait_enqueue_slot, writes pixels and descriptor and publishes it with enqueue; the consumer gets the oldest
+// published slot with wait_dequeue (or try_dequeue / a timeout) and hands it back with release. Free and
+// published slots are counted by two process shared semaphores. The creating process owns and unlinks the
+// segment, after wait_drained when it ends the stream. Both sides record their pid in the header and every wait is a timed one that looks at the other
+// process between slices, so when the peer crashes or detaches the waiting side fails instead of hanging.
+// No OpenCV dependency, so either side can be built without it.
+class Shm_ring
+{
+    public:
+    Shm_ring()
+    {
+        header = NULL;
+        base = NULL;
+        map_bytes = 0;
+        owner = false;
+        write_slot = -1;
+        read_slot = -1;
+    }
+
+    ~Shm_ring()
+    {
+        close();
+    }
+
+    bool create(const std::string &name_, int num_slots, size_t slot_bytes)
+    {
+        close();
+        name = name_;
+        if(num_slots < 1 || num_slots > SHM_RING_MAX_SLOTS)
+            return false;
+
+        // a segment left over by a crashed run is replaced
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd < 0)
+            return false;
+
+        size_t data_offset = align(sizeof(ring_header), 4096);
+        slot_bytes = align(slot_bytes, 4096);
+        size_t total = data_offset + slot_bytes * num_slots;
+        if(ftruncate(fd, total) < 0 || !map(fd, total))
+        {
+            ::close(fd);
+            shm_unlink(name.c_str());
+            return false;
+        }
+        ::close(fd);
+        owner = true;
+
+        header->num_slots = num_slots;
+        header->slot_bytes = slot_bytes;
+        header->data_offset = data_offset;
+        header->write_pos = 0;
+        header->read_pos = 0;
+        header->producer_pid = getpid();
+        header->consumer_pid = 0;
+        sem_init(&header->free_slots, 1, num_slots);
+        sem_init(&header->ready_slots, 1, 0);
+        memset(header->groups, 0, sizeof(header->groups));
+
+        // the consumer checks the magic last, so it only sees an initialized header
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = SHM_RING_MAGIC;
+        return true;
+    }
+
+    bool open(const std::string &name_)
+    {
+        close();
+        name = name_;
+
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if(fd < 0)
+            return false;
+
+        struct stat st;
+        bool ok = (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ring_header) && map(fd, st.st_size));
+        ::close(fd);
+        if(!ok)
+            return false;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(header->magic != SHM_RING_MAGIC)
+        {
+            close();
+            return false;
+        }
+        header->consumer_pid = getpid();
+        return true;
+    }
+
+    void close()
+    {
+        if(!header)
+            return;
+
+        // the semaphores are not destroyed, the other process may still be waiting on them; they go
+        // away with the segment once both sides unmapped it
+        if(owner)
+            shm_unlink(name.c_str());
+        else
+            header->consumer_pid = -1;
+        munmap(header, map_bytes);
+        header = NULL;
+        base = NULL;
+        owner = false;
+        write_slot = -1;
+        read_slot = -1;
+    }
+
+    int num_slots() const
+    {
+        return header ? header->num_slots : 0;
+    }
+
+    size_t slot_bytes() const
+    {
+        return header ? header->slot_bytes : 0;
+    }
+
+    // The other process exited or died (the consumer counts only once it attached)
+    bool peer_gone() const
+    {
+        if(!header)
+            return true;
+        return !alive(owner ? header->consumer_pid : header->producer_pid);
+    }
+
+    // The consumer closed the ring on purpose, e.g. after the last frame it wanted
+    bool peer_detached() const
+    {
+        return header && owner && header->consumer_pid < 0;
+    }
+
+    // Producer side. Blocks for a free slot, returns its memory and descriptor to fill in, or NULL once the
+    // consumer is gone.
+    unsigned char* wait_enqueue_slot(shm_group_desc *&desc)
+    {
+        if(!header || !wait(&header->free_slots, -1))
+            return NULL;
+
+        write_slot = header->write_pos % header->num_slots;
+        desc = &header->groups[write_slot];
+        memset(desc, 0, sizeof(shm_group_desc));
+        desc->sequence = header->write_pos;
+        return slot_data(write_slot);
+    }
+
+    void enqueue()
+    {
+        if(write_slot < 0)
+            return;
+
+        header->write_pos++;
+        write_slot = -1;
+        sem_post(&header->ready_slots);
+    }
+
+    // Publishes an end of stream group, the consumer's dequeue fails once it reaches it
+    void finish()
+    {
+        shm_group_desc* desc;
+        if(wait_enqueue_slot(desc))
+        {
+            desc->end = 1;
+            enqueue();
+        }
+    }
+
+    // Producer side, after finish(). The owner unlinks the segment on close, so a short stream must not close
+    // before its consumer even opened the ring: waits until a consumer attached and read up to the end marker,
+    // or closed the ring. False when the consumer died first.
+    bool wait_drained()
+    {
+        if(!header)
+            return true;
+
+        while(true)
+        {
+            int32_t consumer = header->consumer_pid;
+            if(consumer < 0)
+                return true;
+            if(consumer != 0)
+            {
+                if(!alive(consumer))
+                    return false;
+                if(header->read_pos + 1 >= header->write_pos)
+                    return true;
+            }
+            usleep(10000);
+        }
+    }
+
+    // Consumer side. Returns the oldest published slot, or NULL at the end of the stream, when the producer
+    // died, or after timeout_usecs (negative waits as long as the producer lives) without one.
+    unsigned char* wait_dequeue(const shm_group_desc *&desc, int64_t timeout_usecs = -1)
+    {
+        if(!header || !wait(&header->ready_slots, timeout_usecs))
+            return NULL;
+        return take(desc);
+    }
+
+    unsigned char* try_dequeue(const shm_group_desc *&desc)
+    {
+        if(!header || sem_trywait(&header->ready_slots) != 0)
+            return NULL;
+        return take(desc);
+    }
+
+    bool finished() const
+    {
+        return header && header->groups[header->read_pos % header->num_slots].end && read_slot < 0;
+    }
+
+    void release()
+    {
+        if(read_slot < 0)
+            return;
+
+        header->read_pos++;
+        read_slot = -1;
+        sem_post(&header->free_slots);
+    }
+
+    private:
+    struct ring_header
+    {
+        uint32_t magic;
+        uint32_t num_slots;
+        uint64_t slot_bytes;
+        uint64_t data_offset;
+        uint64_t write_pos;     // written by the producer only
+        uint64_t read_pos;      // written by the consumer only
+        int32_t producer_pid;
+        int32_t consumer_pid;   // 0 until a consumer opened the ring, -1 after it closed it
+        sem_t free_slots;
+        sem_t ready_slots;
+        shm_group_desc groups[SHM_RING_MAX_SLOTS];
+    };
+
+    static size_t align(size_t size, size_t alignment)
+    {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    bool map(int fd, size_t bytes)
+    {
+        void* ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(ptr == MAP_FAILED)
+            return false;
+
+        header = (ring_header*)ptr;
+        base = (unsigned char*)ptr;
+        map_bytes = bytes;
+        return true;
+    }
+
+    unsigned char* slot_data(int slot)
+    {
+        return base + header->data_offset + (size_t)slot * header->slot_bytes;
+    }
+
+    static bool alive(int32_t pid)
+    {
+        if(pid == 0)
+            return true;
+        if(pid < 0)
+            return false;
+        return kill(pid, 0) == 0 || errno == EPERM;
+    }
+
+    // Waits in slices of at most 100 ms, checking between them that the peer is still there
+    bool wait(sem_t *sem, int64_t timeout_usecs)
+    {
+        const int64_t slice_usecs = 100000;
+        while(true)
+        {
+            int64_t wait_usecs = (timeout_usecs < 0 || timeout_usecs > slice_usecs) ? slice_usecs : timeout_usecs;
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait_usecs / 1000000;
+            deadline.tv_nsec += (wait_usecs % 1000000) * 1000;
+            if(deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            if(sem_timedwait(sem, &deadline) == 0)
+                return true;
+            if(errno == EINTR)
+                continue;
+            if(errno != ETIMEDOUT || peer_gone())
+                return false;
+
+            if(timeout_usecs >= 0)
+            {
+                timeout_usecs -= wait_usecs;
+                if(timeout_usecs <= 0)
+                    return false;
+            }
+        }
+    }
+
+    unsigned char* take(const shm_group_desc *&desc)
+    {
+        int slot = header->read_pos % header->num_slots;
+        if(header->groups[slot].end)
+        {
+            // leave the end marker published so finished() and later calls see it
+            sem_post(&header->ready_slots);
+            return NULL;
+        }
+
+        read_slot = slot;
+        desc = &header->groups[slot];
+        return slot_data(slot);
+    }
+
+    std::string name;
+    ring_header* header;
+    unsigned char* base;
+    size_t map_bytes;
+    bool owner;
+    int write_slot;
+    int read_slot;
+};
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef STITCH_KERNELS_HPP
+#define STITCH_KERNELS_HPP
+
+#include "opencv2/core.hpp"
+#include "opencv2/core/hal/intrin.hpp"
+
+// Per pixel kernels of the composition path, one instantiation per pixel type and channel count so the inner
+// loops are fixed at compile time. The combinations the stitcher calls (gain on 8UC3, accumulate 8UC3 and 8UC1,
+// store to 8U and 16S) are vectorized with OpenCV's universal intrinsics, the rest stay scalar.
+// Gains and weights are one CV_32F value per pixel, accumulators CV_32FC(cn).
+namespace stitch_kernels
+{
+
+// pixel = saturate(pixel * gain)
+template<typename T, int cn> struct gain_row
+{
+    static void run(T* row, const float* gain, int width)
+    {
+        for(int x = 0; x < width; x++)
+            for(int c = 0; c < cn; c++)
+                row[x * cn + c] = cv::saturate_cast<T>(row[x * cn + c] * gain[x]);
+    }
+};
+
+// acc += pixel * weight
+template<typename T, int cn> struct accumulate_row
+{
+    static void run(const T* src, const float* weight, float* acc, int width)
+    {
+        for(int x = 0; x < width; x++)
+            for(int c = 0; c < cn; c++)
+                acc[x * cn + c] += src[x * cn + c] * weight[x];
+    }
+};
+
+// dst = saturate(round(acc))
+template<typename T, int cn> struct store_row
+{
+    static void run(const float* acc, T* dst, int width)
+    {
+        for(int x = 0; x < width * cn; x++)
+            dst[x] = cv::saturate_cast<T>(acc[x]);
+    }
+};
+
+#if CV_SIMD128
+inline cv::v_uint8x16 scale_u8(const cv::v_uint8x16 &a, const cv::v_float32x4 g[4])
+{
+    cv::v_uint16x8 a0, a1;
+    cv::v_uint32x4 b0, b1, b2, b3;
+    cv::v_expand(a, a0, a1);
+    cv::v_expand(a0, b0, b1);
+    cv::v_expand(a1, b2, b3);
+
+    cv::v_int32x4 r0 = cv::v_round(cv::v_cvt_f32(cv::v_reinterpret_as_s32(b0)) * g[0]);
+    cv::v_int32x4 r1 = cv::v_round(cv::v_cvt_f32(cv::v_reinterpret_as_s32(b1)) * g[1]);
+    cv::v_int32x4 r2 = cv::v_round(cv::v_cvt_f32(cv::v_reinterpret_as_s32(b2)) * g[2]);
+    cv::v_int32x4 r3 = cv::v_round(cv::v_cvt_f32(cv::v_reinterpret_as_s32(b3)) * g[3]);
+    return cv::v_pack(cv::v_pack_u(r0, r1), cv::v_pack_u(r2, r3));
+}
+
+inline void expand_u8(const cv::v_uint8x16 &a, cv::v_float32x4 f[4])
+{
+    cv::v_uint16x8 a0, a1;
+    cv::v_uint32x4 b0, b1, b2, b3;
+    cv::v_expand(a, a0, a1);
+    cv::v_expand(a0, b0, b1);
+    cv::v_expand(a1, b2, b3);
+    f[0] = cv::v_cvt_f32(cv::v_reinterpret_as_s32(b0));
+    f[1] = cv::v_cvt_f32(cv::v_reinterpret_as_s32(b1));
+    f[2] = cv::v_cvt_f32(cv::v_reinterpret_as_s32(b2));
+    f[3] = cv::v_cvt_f32(cv::v_reinterpret_as_s32(b3));
+}
+
+template<> struct gain_row<uchar, 3>
+{
+    static void run(uchar* row, const float* gain, int width)
+    {
+        int x = 0;
+        for(; x <= width - 16; x += 16)
+        {
+            cv::v_float32x4 g[4] = {cv::v_load(gain + x), cv::v_load(gain + x + 4), cv::v_load(gain + x + 8), cv::v_load(gain + x + 12)};
+            cv::v_uint8x16 b, gr, r;
+            cv::v_load_deinterleave(row + x * 3, b, gr, r);
+            cv::v_store_interleave(row + x * 3, scale_u8(b, g), scale_u8(gr, g), scale_u8(r, g));
+        }
+        for(; x < width; x++)
+        {
+            row[x * 3] = cv::saturate_cast<uchar>(row[x * 3] * gain[x]);
+            row[x * 3 + 1] = cv::saturate_cast<uchar>(row[x * 3 + 1] * gain[x]);
+            row[x * 3 + 2] = cv::saturate_cast<uchar>(row[x * 3 + 2] * gain[x]);
+        }
+    }
+};
+
+template<> struct accumulate_row<uchar, 1>
+{
+    static void run(const uchar* src, const float* weight, float* acc, int width)
+    {
+        int x = 0;
+        for(; x <= width - 16; x += 16)
+        {
+            cv::v_float32x4 f[4];
+            expand_u8(cv::v_load(src + x), f);
+            for(int k = 0; k < 4; k++)
+                cv::v_store(acc + x + 4 * k, cv::v_load(acc + x + 4 * k) + f[k] * cv::v_load(weight + x + 4 * k));
+        }
+        for(; x < width; x++)
+            acc[x] += src[x] * weight[x];
+    }
+};
+
+template<> struct accumulate_row<uchar, 3>
+{
+    static void run(const uchar* src, const float* weight, float* acc, int width)
+    {
+        int x = 0;
+        for(; x <= width - 16; x += 16)
+        {
+            cv::v_uint8x16 b, g, r;
+            cv::v_load_deinterleave(src + x * 3, b, g, r);
+            cv::v_float32x4 fb[4], fg[4], fr[4];
+            expand_u8(b, fb);
+            expand_u8(g, fg);
+            expand_u8(r, fr);
+            for(int k = 0; k < 4; k++)
+            {
+                float* a = acc + (x + 4 * k) * 3;
+                cv::v_float32x4 w = cv::v_load(weight + x + 4 * k);
+                cv::v_float32x4 ab, ag, ar;
+                cv::v_load_deinterleave(a, ab, ag, ar);
+                cv::v_store_interleave(a, ab + fb[k] * w, ag + fg[k] * w, ar + fr[k] * w);
+            }
+        }
+        for(; x < width; x++)
+        {
+            acc[x * 3] += src[x * 3] * weight[x];
+            acc[x * 3 + 1] += src[x * 3 + 1] * weight[x];
+            acc[x * 3 + 2] += src[x * 3 + 2] * weight[x];
+        }
+    }
+};
+
+// the channels are stored interleaved, so storing is the same loop for every channel count
+template<int cn> struct store_row<uchar, cn>
+{
+    static void run(const float* acc, uchar* dst, int width)
+    {
+        int x = 0, n = width * cn;
+        for(; x <= n - 16; x += 16)
+        {
+            cv::v_int32x4 r0 = cv::v_round(cv::v_load(acc + x)), r1 = cv::v_round(cv::v_load(acc + x + 4));
+            cv::v_int32x4 r2 = cv::v_round(cv::v_load(acc + x + 8)), r3 = cv::v_round(cv::v_load(acc + x + 12));
+            cv::v_store(dst + x, cv::v_pack(cv::v_pack_u(r0, r1), cv::v_pack_u(r2, r3)));
+        }
+        for(; x < n; x++)
+            dst[x] = cv::saturate_cast<uchar>(acc[x]);
+    }
+};
+
+template<int cn> struct store_row<short, cn>
+{
+    static void run(const float* acc, short* dst, int width)
+    {
+        int x = 0, n = width * cn;
+        for(; x <= n - 8; x += 8)
+            cv::v_store(dst + x, cv::v_pack(cv::v_round(cv::v_load(acc + x)), cv::v_round(cv::v_load(acc + x + 4))));
+        for(; x < n; x++)
+            dst[x] = cv::saturate_cast<short>(acc[x]);
+    }
+};
+#endif
+
+template<typename T, int cn> void apply_gain(cv::Mat &image, const cv::Mat &gain)
+{
+    CV_Assert(image.type() == CV_MAKETYPE(cv::DataType<T>::depth, cn) && gain.type() == CV_32F && gain.size() == image.size());
+    for(int y = 0; y < image.rows; y++)
+        gain_row<T, cn>::run(image.ptr<T>(y), gain.ptr<float>(y), image.cols);
+}
+
+template<typename T, int cn> void accumulate_weighted(const cv::Mat &src, const cv::Mat &weight, cv::Mat &acc)
+{
+    CV_Assert(src.type() == CV_MAKETYPE(cv::DataType<T>::depth, cn) && weight.type() == CV_32F && acc.type() == CV_32FC(cn));
+    CV_Assert(weight.size() == src.size() && acc.size() == src.size());
+    for(int y = 0; y < src.rows; y++)
+        accumulate_row<T, cn>::run(src.ptr<T>(y), weight.ptr<float>(y), acc.ptr<float>(y), src.cols);
+}
+
+template<typename T, int cn> void store_accumulated(const cv::Mat &acc, cv::Mat &dst)
+{
+    CV_Assert(acc.type() == CV_32FC(cn) && dst.type() == CV_MAKETYPE(cv::DataType<T>::depth, cn) && dst.size() == acc.size());
+    for(int y = 0; y < acc.rows; y++)
+        store_row<T, cn>::run(acc.ptr<float>(y), dst.ptr<T>(y), acc.cols);
+}
+
+}
+
+#endif
@@ -4,15 +4,600 @@ using namespace std;
 using namespace cv;
 using namespace cv::detail;
 
+void Basic_stitcher::set_overlap_features(bool enable, int margin)
+{
+    overlap_features = enable;
+    overlap_margin = margin;
+}
+
+void Basic_stitcher::set_adjust_budget(bool warm_start, int max_iterations, double max_ms, double min_error_delta, int chunk_iterations)
+{
+    adjust_warm_start = warm_start;
+    adjust_max_iterations = max_iterations;
+    adjust_max_ms = max_ms;
+    adjust_min_error_delta = min_error_delta;
+    adjust_chunk_iterations = max(1, chunk_iterations);
+}
+
 void Basic_stitcher::set_megapix (double work_megapix_, double seam_megapix_, double compose_megapix_)
 {
     work_megapix = work_megapix_;
     seam_megapix = seam_megapix_;
     compose_megapix = compose_megapix_;
+    prepare_maps_version = -1;
+    compose_maps_version = -1;
+}
+
+// Greedy edge coloring of the overlapping image pairs, the pairs of one batch touch every image at most once
+static vector<vector<pair<int, int> > > overlap_pair_batches(const vector<Rect> &rects)
+{
+    int num_images = rects.size();
+    vector<vector<pair<int, int> > > batches;
+    vector<vector<bool> > busy;
+    for (int i = 0; i < num_images; ++i)
+    {
+        for (int j = i + 1; j < num_images; ++j)
+        {
+            if ((rects[i] & rects[j]).area() == 0)
+                continue;
+
+            int color = 0;
+            while (color < batches.size() && (busy[color][i] || busy[color][j]))
+                color++;
+            if (color == batches.size())
+            {
+                batches.push_back(vector<pair<int, int> >());
+                busy.push_back(vector<bool>(num_images, false));
+            }
+            batches[color].push_back(make_pair(i, j));
+            busy[color][i] = true;
+            busy[color][j] = true;
+        }
+    }
+
+    return batches;
+}
+
+Parallel_graph_cut_seam_finder::Parallel_graph_cut_seam_finder(int cost_type_, float terminal_cost_, float bad_region_penalty_)
+{
+    cost_type = cost_type_;
+    terminal_cost = terminal_cost_;
+    bad_region_penalty = bad_region_penalty_;
+}
+
+void Parallel_graph_cut_seam_finder::find(const vector<UMat> &src, const vector<Point> &corners, vector<UMat> &masks)
+{
+    const int gap = 10;
+    int num_images = src.size();
+    vector<Rect> rects(num_images);
+    vector<Mat> src_mats(num_images);
+    vector<Mat> mask_mats(num_images);
+    for (int i = 0; i < num_images; ++i)
+    {
+        rects[i] = Rect(corners[i], src[i].size());
+        src_mats[i] = src[i].getMat(ACCESS_READ);
+        mask_mats[i] = masks[i].getMat(ACCESS_RW);
+    }
+
+    vector<vector<pair<int, int> > > batches = overlap_pair_batches(rects);
+
+    for (int b = 0; b < batches.size(); ++b)
+    {
+        const vector<pair<int, int> > &batch = batches[b];
+        parallel_for_(Range(0, (int)batch.size()), [&](const Range &range)
+        {
+            for (int p = range.start; p < range.end; ++p)
+            {
+                int i = batch[p].first;
+                int j = batch[p].second;
+                Rect overlap = rects[i] & rects[j];
+                Rect around(overlap.x - gap, overlap.y - gap, overlap.width + 2 * gap, overlap.height + 2 * gap);
+                Rect crop_i = around & rects[i];
+                Rect crop_j = around & rects[j];
+
+                vector<UMat> images_pair(2);
+                vector<UMat> masks_pair(2);
+                vector<Point> corners_pair(2);
+                src_mats[i](crop_i - corners[i]).convertTo(images_pair[0], CV_32F);
+                src_mats[j](crop_j - corners[j]).convertTo(images_pair[1], CV_32F);
+                mask_mats[i](crop_i - corners[i]).copyTo(masks_pair[0]);
+                mask_mats[j](crop_j - corners[j]).copyTo(masks_pair[1]);
+                corners_pair[0] = crop_i.tl();
+                corners_pair[1] = crop_j.tl();
+
+                GraphCutSeamFinder pair_finder(cost_type, terminal_cost, bad_region_penalty);
+                pair_finder.find(images_pair, corners_pair, masks_pair);
+
+                masks_pair[0].copyTo(mask_mats[i](crop_i - corners[i]));
+                masks_pair[1].copyTo(mask_mats[j](crop_j - corners[j]));
+            }
+        });
+    }
+}
+
+Temporal_seam_finder::Temporal_seam_finder(int band_width_, float temporal_cost_)
+{
+    band_width = band_width_;
+    temporal_cost = temporal_cost_;
+    initial_finder = makePtr<Parallel_graph_cut_seam_finder>(GraphCutSeamFinderBase::COST_COLOR);
+}
+
+void Temporal_seam_finder::reset()
+{
+    prev_rects.clear();
+    prev_masks.clear();
+}
+
+void Temporal_seam_finder::find(const vector<UMat> &src, const vector<Point> &corners, vector<UMat> &masks)
+{
+    int num_images = src.size();
+    vector<Rect> rects(num_images);
+    for (int i = 0; i < num_images; ++i)
+        rects[i] = Rect(corners[i], src[i].size());
+
+    if (rects != prev_rects)
+    {
+        // first frame or new geometry, nothing to stay coherent with
+        initial_finder->find(src, corners, masks);
+    }
+    else
+    {
+        vector<Mat> src_mats(num_images);
+        vector<Mat> mask_mats(num_images);
+        for (int i = 0; i < num_images; ++i)
+        {
+            src_mats[i] = src[i].getMat(ACCESS_READ);
+            mask_mats[i] = masks[i].getMat(ACCESS_RW);
+        }
+
+        vector<vector<pair<int, int> > > batches = overlap_pair_batches(rects);
+        for (int b = 0; b < batches.size(); ++b)
+        {
+            const vector<pair<int, int> > &batch = batches[b];
+            parallel_for_(Range(0, (int)batch.size()), [&](const Range &range)
+            {
+                for (int p = range.start; p < range.end; ++p)
+                {
+                    int i = batch[p].first;
+                    int j = batch[p].second;
+                    find_in_pair(src_mats[i], src_mats[j], mask_mats[i], mask_mats[j], prev_masks[i], prev_masks[j], rects[i], rects[j]);
+                }
+            });
+        }
+    }
+
+    prev_rects = rects;
+    prev_masks.resize(num_images);
+    for (int i = 0; i < num_images; ++i)
+        masks[i].copyTo(prev_masks[i]);
+}
+
+void Temporal_seam_finder::find_in_pair(const Mat &img1, const Mat &img2, Mat &mask1, Mat &mask2, const Mat &prev1, const Mat &prev2, Rect rect1, Rect rect2)
+{
+    const float weight_eps = 1.f;
+    Rect overlap = rect1 & rect2;
+    Rect roi1 = overlap - rect1.tl();
+    Rect roi2 = overlap - rect2.tl();
+    int w = overlap.width;
+    int h = overlap.height;
+
+    Mat f1, f2;
+    img1(roi1).convertTo(f1, CV_32F, 1.0 / 255);
+    img2(roi2).convertTo(f2, CV_32F, 1.0 / 255);
+    if (f1.channels() == 1)
+    {
+        cvtColor(f1, f1, COLOR_GRAY2BGR);
+        cvtColor(f2, f2, COLOR_GRAY2BGR);
+    }
+
+    // overlap views of the masks, writing to them writes the masks
+    Mat overlap1 = mask1(roi1);
+    Mat overlap2 = mask2(roi2);
+    Mat prev_overlap1 = prev1(roi1);
+    Mat prev_overlap2 = prev2(roi2);
+
+    // label of every overlap pixel: 0 image 1, 1 image 2, 2 contested without a previous owner, -1 neither
+    Mat_<schar> label(h, w);
+    Mat_<uchar> contested(h, w);
+    for (int y = 0; y < h; ++y)
+    {
+        const uchar* row1 = overlap1.ptr<uchar>(y);
+        const uchar* row2 = overlap2.ptr<uchar>(y);
+        const uchar* prev_row1 = prev_overlap1.ptr<uchar>(y);
+        const uchar* prev_row2 = prev_overlap2.ptr<uchar>(y);
+        for (int x = 0; x < w; ++x)
+        {
+            bool in1 = row1[x] != 0;
+            bool in2 = row2[x] != 0;
+            contested(y, x) = (in1 && in2) ? 1 : 0;
+            if (in1 && in2)
+            {
+                if (prev_row1[x])
+                    label(y, x) = 0;
+                else if (prev_row2[x])
+                    label(y, x) = 1;
+                else
+                    label(y, x) = 2;
+            }
+            else
+            {
+                label(y, x) = in1 ? 0 : (in2 ? 1 : -1);
+            }
+        }
+    }
+
+    // the previous seam runs between contested pixels of different previous owners
+    Mat_<uchar> not_seam(h, w, (uchar)255);
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            if (!contested(y, x) || label(y, x) == 2)
+                continue;
+            if ((x + 1 < w && contested(y, x + 1) && label(y, x + 1) == 1 - label(y, x))
+                || (y + 1 < h && contested(y + 1, x) && label(y + 1, x) == 1 - label(y, x)))
+                not_seam(y, x) = 0;
+        }
+    }
+    Mat dist;
+    distanceTransform(not_seam, dist, DIST_L2, 3);
+
+    Mat_<int> node(h, w, -1);
+    int node_count = 0;
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            if (contested(y, x) && (label(y, x) == 2 || dist.at<float>(y, x) <= band_width))
+                node(y, x) = node_count++;
+        }
+    }
+    if (node_count == 0)
+    {
+        // seam far from any change, keep the previous assignment
+        for (int y = 0; y < h; ++y)
+        {
+            uchar* row1 = overlap1.ptr<uchar>(y);
+            uchar* row2 = overlap2.ptr<uchar>(y);
+            for (int x = 0; x < w; ++x)
+            {
+                if (!contested(y, x))
+                    continue;
+                row1[x] = label(y, x) == 0 ? 255 : 0;
+                row2[x] = label(y, x) == 0 ? 0 : 255;
+            }
+        }
+        return;
+    }
+
+    // source is image 1, sink image 2. fromSource is paid when a pixel ends up in image 2, toSink for image 1.
+    GCGraph<float> graph(node_count, node_count * 4);
+    for (int k = 0; k < node_count; ++k)
+        graph.addVtx();
+
+    const int dx[4] = {1, 0, -1, 0};
+    const int dy[4] = {0, 1, 0, -1};
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            int v = node(y, x);
+            if (v < 0)
+                continue;
+
+            float from_source = 0;
+            float to_sink = 0;
+            if (label(y, x) == 0)
+                from_source += temporal_cost;
+            else if (label(y, x) == 1)
+                to_sink += temporal_cost;
+
+            Point3f d = f1.at<Point3f>(y, x) - f2.at<Point3f>(y, x);
+            float cost_p = d.dot(d);
+
+            for (int n = 0; n < 4; ++n)
+            {
+                int qx = x + dx[n];
+                int qy = y + dy[n];
+                int q_label;
+                float weight;
+
+                if (qx >= 0 && qy >= 0 && qx < w && qy < h)
+                {
+                    Point3f e = f1.at<Point3f>(qy, qx) - f2.at<Point3f>(qy, qx);
+                    weight = cost_p + e.dot(e) + weight_eps;
+                    if (node(qy, qx) >= 0)
+                    {
+                        if (n < 2)
+                            graph.addEdges(v, node(qy, qx), weight, weight);
+                        continue;
+                    }
+                    q_label = label(qy, qx);
+                }
+                else
+                {
+                    // outside the overlap only one of the two images can be present
+                    Point q = Point(qx, qy) + overlap.tl();
+                    weight = 2 * cost_p + weight_eps;
+                    if (rect1.contains(q) && mask1.at<uchar>(q - rect1.tl()))
+                        q_label = 0;
+                    else if (rect2.contains(q) && mask2.at<uchar>(q - rect2.tl()))
+                        q_label = 1;
+                    else
+                        q_label = -1;
+                }
+
+                if (q_label == 0)
+                    from_source += weight;
+                else if (q_label == 1)
+                    to_sink += weight;
+            }
+
+            graph.addTermWeights(v, from_source, to_sink);
+        }
+    }
+
+    graph.maxFlow();
+
+    for (int y = 0; y < h; ++y)
+    {
+        uchar* row1 = overlap1.ptr<uchar>(y);
+        uchar* row2 = overlap2.ptr<uchar>(y);
+        for (int x = 0; x < w; ++x)
+        {
+            if (!contested(y, x))
+                continue;
+
+            bool to_first;
+            if (node(y, x) >= 0)
+                to_first = graph.inSourceSegment(node(y, x));
+            else
+                to_first = (label(y, x) == 0);
+            row1[x] = to_first ? 255 : 0;
+            row2[x] = to_first ? 0 : 255;
+        }
+    }
+}
+
+void Basic_stitcher::set_preset(pipeline_preset preset)
+{
+    switch(preset)
+    {
+        case PRESET_QUALITY:
+        set_bundle_adjuster(ADJUST_RAY);
+        set_seam_finder(SEAM_GRAPHCUT_COLOR);
+        set_exposure_compensator(ExposureCompensator::GAIN_BLOCKS);
+        set_blender(Blender::MULTI_BAND);
+        break;
+
+        case PRESET_BALANCED:
+        set_bundle_adjuster(ADJUST_RAY, 50);
+        set_seam_finder(SEAM_DP_COLOR);
+        set_exposure_compensator(ExposureCompensator::GAIN);
+        set_blender(Blender::MULTI_BAND, 3);
+        break;
+
+        case PRESET_REALTIME:
+        set_bundle_adjuster(ADJUST_NO);
+        set_seam_finder(SEAM_VORONOI);
+        set_exposure_compensator(ExposureCompensator::GAIN);
+        set_blender(BLEND_FEATHER_MAPS);
+        break;
+    }
+}
+
+void Basic_stitcher::set_seam_finder(seam_type type)
+{
+    seam_finder_type = type;
+    switch(type)
+    {
+        case SEAM_NO:
+        seam_finder = makePtr<NoSeamFinder>();
+        break;
+
+        case SEAM_VORONOI:
+        seam_finder = makePtr<VoronoiSeamFinder>();
+        break;
+
+        case SEAM_DP_COLOR:
+        seam_finder = makePtr<DpSeamFinder>(DpSeamFinder::COLOR);
+        break;
+
+        case SEAM_DP_COLOR_GRAD:
+        seam_finder = makePtr<DpSeamFinder>(DpSeamFinder::COLOR_GRAD);
+        break;
+
+        case SEAM_GRAPHCUT_COLOR:
+        case SEAM_GRAPHCUT_COLOR_GRAD:
+        {
+            int cost_type = (type == SEAM_GRAPHCUT_COLOR) ? GraphCutSeamFinderBase::COST_COLOR : GraphCutSeamFinderBase::COST_COLOR_GRAD;
+#ifdef HAVE_OPENCV_CUDALEGACY
+            if(use_cuda)
+                seam_finder = makePtr<GraphCutSeamFinderGpu>(cost_type);
+            else
+#endif
+            seam_finder = makePtr<GraphCutSeamFinder>(cost_type);
+        }
+        break;
+
+        case SEAM_GRAPHCUT_PARALLEL:
+        seam_finder = makePtr<Parallel_graph_cut_seam_finder>(GraphCutSeamFinderBase::COST_COLOR);
+        break;
+
+        case SEAM_TEMPORAL:
+        seam_finder = makePtr<Temporal_seam_finder>();
+        break;
+    }
+}
+
+void Basic_stitcher::set_exposure_compensator(int type)
+{
+    compensator = ExposureCompensator::createDefault(type);
+}
+
+void Basic_stitcher::set_blender(int type, int num_bands)
+{
+    blend_type = type;
+    blend_bands = num_bands;
+    blender = create_blender();
+}
+
+void Basic_stitcher::set_bundle_adjuster(adjust_type type, int max_iterations)
+{
+    switch(type)
+    {
+        case ADJUST_NO:
+        adjuster = makePtr<NoBundleAdjuster>();
+        break;
+
+        case ADJUST_RAY:
+        adjuster = makePtr<BundleAdjusterRay>();
+        break;
+
+        case ADJUST_REPROJ:
+        adjuster = makePtr<BundleAdjusterReproj>();
+        break;
+    }
+
+    if(max_iterations > 0)
+        adjuster->setTermCriteria(TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, max_iterations, DBL_EPSILON));
+}
+
+bool Basic_stitcher::set_option(const string &name, const string &value)
+{
+    if(name == "preset")
+    {
+        if(value == "quality")
+            set_preset(PRESET_QUALITY);
+        else if(value == "balanced")
+            set_preset(PRESET_BALANCED);
+        else if(value == "realtime")
+            set_preset(PRESET_REALTIME);
+        else
+            return false;
+    }
+    else if(name == "seam")
+    {
+        if(value == "no")
+            set_seam_finder(SEAM_NO);
+        else if(value == "voronoi")
+            set_seam_finder(SEAM_VORONOI);
+        else if(value == "dp_color")
+            set_seam_finder(SEAM_DP_COLOR);
+        else if(value == "dp_colorgrad")
+            set_seam_finder(SEAM_DP_COLOR_GRAD);
+        else if(value == "gc_color")
+            set_seam_finder(SEAM_GRAPHCUT_COLOR);
+        else if(value == "gc_colorgrad")
+            set_seam_finder(SEAM_GRAPHCUT_COLOR_GRAD);
+        else if(value == "gc_parallel")
+            set_seam_finder(SEAM_GRAPHCUT_PARALLEL);
+        else if(value == "temporal")
+            set_seam_finder(SEAM_TEMPORAL);
+        else
+            return false;
+    }
+    else if(name == "expos")
+    {
+        if(value == "no")
+            set_exposure_compensator(ExposureCompensator::NO);
+        else if(value == "gain")
+            set_exposure_compensator(ExposureCompensator::GAIN);
+        else if(value == "gain_blocks")
+            set_exposure_compensator(ExposureCompensator::GAIN_BLOCKS);
+        else
+            return false;
+    }
+    else if(name == "blend")
+    {
+        if(value == "no")
+            set_blender(Blender::NO);
+        else if(value == "feather")
+            set_blender(Blender::FEATHER);
+        else if(value == "multiband")
+            set_blender(Blender::MULTI_BAND);
+        else if(value == "feather_maps")
+            set_blender(BLEND_FEATHER_MAPS);
+        else
+            return false;
+    }
+    else if(name == "ba")
+    {
+        if(value == "no")
+            set_bundle_adjuster(ADJUST_NO);
+        else if(value == "ray")
+            set_bundle_adjuster(ADJUST_RAY);
+        else if(value == "reproj")
+            set_bundle_adjuster(ADJUST_REPROJ);
+        else
+            return false;
+    }
+    else if(name == "topology")
+    {
+        if(value == "all")
+            set_rig_topology(TOPOLOGY_ALL);
+        else if(value == "ring")
+            set_rig_topology(TOPOLOGY_RING, topology_range);
+        else if(value == "range")
+            set_rig_topology(TOPOLOGY_RANGE, topology_range);
+        else
+            return false;
+    }
+    else if(name == "topology_range")
+    {
+        int range = atoi(value.c_str());
+        if(range <= 0)
+            return false;
+        topology_range = range;
+    }
+    else if(name == "overlap_features")
+    {
+        if(value == "on")
+            set_overlap_features(true);
+        else if(value == "off")
+            set_overlap_features(false);
+        else
+            return false;
+    }
+    else if(name == "ba_budget_ms")
+    {
+        double ms = atof(value.c_str());
+        if(ms <= 0)
+            return false;
+        set_adjust_budget(true, adjust_max_iterations, ms, adjust_min_error_delta, adjust_chunk_iterations);
+    }
+    else if(name == "incremental")
+    {
+        if(value == "on")
+            set_incremental(true);
+        else if(value == "off")
+            set_incremental(false);
+        else
+            return false;
+    }
+    else if(name == "ba_iters")
+    {
+        int iters = atoi(value.c_str());
+        if(iters <= 0)
+            return false;
+        adjuster->setTermCriteria(TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, iters, DBL_EPSILON));
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
 }
 
 void Basic_stitcher::update_image_scale(vector<Mat> &full_img)
 {
+    work_scale.clear();
+    seam_scale.clear();
+    seam_work_aspect.clear();
+    compose_scale.clear();
+    compose_work_aspect.clear();
+
     for(int i = 0; i < full_img.size(); i++)
     {
         double work_scale_;
@@ -34,18 +619,20 @@ void Basic_stitcher::update_image_scale(vector<Mat> &full_img)
         else
         {
             seam_scale_ = 1;
-            seam_work_aspect_ = 1;
+            seam_work_aspect_ = seam_scale_ / work_scale_;
         }
 
         if(compose_megapix > 0)
         {
             compose_scale_ = min(1.0, sqrt(compose_megapix * 1e6 / full_img[i].size().area()));
+            if(std::abs(compose_scale_ - 1) <= 1e-1)
+                compose_scale_ = 1;
             compose_work_aspect_ = compose_scale_ / work_scale_;
         }
         else
         {
             compose_scale_ = 1;
-            compose_work_aspect_ = 1;
+            compose_work_aspect_ = compose_scale_ / work_scale_;
         }
 
         work_scale.push_back(work_scale_);
@@ -56,22 +643,121 @@ void Basic_stitcher::update_image_scale(vector<Mat> &full_img)
     }
 }
 
-vector<ImageFeatures> Basic_stitcher::finding_features(const vector<Mat> &imgs)
+double Basic_stitcher::required_input_scale(Size full_size)
+{
+    double scale = 0;
+    double megapix[3] = {work_megapix, seam_megapix, compose_megapix};
+    for(int i = 0; i < 3; i++)
+    {
+        if(megapix[i] <= 0)
+            return 1.0;
+        scale = max(scale, min(1.0, sqrt(megapix[i] * 1e6 / full_size.area())));
+    }
+
+    return scale;
+}
+
+vector<ImageFeatures> Basic_stitcher::finding_features(const vector<Mat> &imgs, const vector<vector<Rect> > &rois)
 {
     vector<ImageFeatures> features(imgs.size());
     for(int i = 0; i < imgs.size(); i++)
     {
-        (*finder)(imgs[i], features[i]);
+        if(i < rois.size() && !rois[i].empty())
+            (*overlap_finder)(imgs[i], features[i], rois[i]);
+        else
+            (*finder)(imgs[i], features[i]);
         features[i].img_idx = i;
     }
+    finder->collectGarbage();
+    overlap_finder->collectGarbage();
 
     return features;
 }
 
+void Basic_stitcher::set_rig_topology(rig_topology topology_, int range)
+{
+    topology = topology_;
+    topology_range = max(1, range);
+    topology_pairs.clear();
+}
+
+void Basic_stitcher::set_rig_topology(const vector<pair<int, int> > &adjacency)
+{
+    topology = TOPOLOGY_LIST;
+    topology_range = 1;
+    topology_pairs = adjacency;
+}
+
+Mat_<uchar> Basic_stitcher::make_match_mask(int num_images)
+{
+    Mat_<uchar> mask(num_images, num_images, (uchar)0);
+
+    switch(topology)
+    {
+        case TOPOLOGY_ALL:
+        mask.setTo(1);
+        break;
+
+        case TOPOLOGY_RING:
+        for(int i = 0; i < num_images; i++)
+        {
+            for(int d = 1; d <= topology_range; d++)
+            {
+                int j = (i + d) % num_images;
+                mask(i, j) = 1;
+                mask(j, i) = 1;
+            }
+        }
+        break;
+
+        case TOPOLOGY_RANGE:
+        for(int i = 0; i < num_images; i++)
+        {
+            for(int j = i + 1; j < min(num_images, i + topology_range + 1); j++)
+            {
+                mask(i, j) = 1;
+                mask(j, i) = 1;
+            }
+        }
+        break;
+
+        case TOPOLOGY_LIST:
+        for(int k = 0; k < topology_pairs.size(); k++)
+        {
+            int i = topology_pairs[k].first;
+            int j = topology_pairs[k].second;
+            if(i < 0 || j < 0 || i >= num_images || j >= num_images)
+            {
+                STICHER_DBG_ERR("rig topology pair (" << i << ", " << j << ") out of range, ignored");
+                continue;
+            }
+            mask(i, j) = 1;
+            mask(j, i) = 1;
+        }
+        break;
+    }
+
+    for(int i = 0; i < num_images; i++)
+        mask(i, i) = 0;
+
+    return mask;
+}
+
 vector<MatchesInfo> Basic_stitcher::pairwise_matching(const vector<ImageFeatures> &features)
 {
+    // Pairs outside the rig topology are left as empty MatchesInfo. The listed pairs are spread over
+    // cv::parallel_for_ by FeaturesMatcher when the matcher is thread safe (the CPU BestOf2NearestMatcher is).
     vector<MatchesInfo> pairwise_matches;
-    (*matcher)(features, pairwise_matches);
+    if(topology == TOPOLOGY_ALL)
+    {
+        (*matcher)(features, pairwise_matches);
+    }
+    else
+    {
+        Mat_<uchar> mask = make_match_mask(features.size());
+        (*matcher)(features, pairwise_matches, mask.getUMat(ACCESS_READ));
+    }
+    matcher->collectGarbage();
 
     return pairwise_matches;
 }
@@ -81,6 +767,27 @@ vector<CameraParams> Basic_stitcher::estimate_camera_params(const vector<ImageFe
     vector<CameraParams> cameras;
     (*estimator)(features, pairwise_matches, cameras);
 
+    adjust_camera_params(features, pairwise_matches, cameras);
+
+    return cameras;
+}
+
+vector<CameraParams> Basic_stitcher::refine_camera_params(const vector<ImageFeatures> &features, const vector<MatchesInfo> &pairwise_matches, const vector<CameraParams> &initial)
+{
+    vector<CameraParams> cameras;
+    for (size_t i = 0; i < initial.size(); ++i)
+    {
+        cameras.push_back(initial[i]);
+        cameras[i].R = initial[i].R.clone();
+    }
+
+    adjust_camera_params(features, pairwise_matches, cameras);
+
+    return cameras;
+}
+
+void Basic_stitcher::adjust_camera_params(const vector<ImageFeatures> &features, const vector<MatchesInfo> &pairwise_matches, vector<CameraParams> &cameras)
+{
     for (size_t i = 0; i < cameras.size(); ++i)
     {
         Mat R;
@@ -98,7 +805,61 @@ vector<CameraParams> Basic_stitcher::estimate_camera_params(const vector<ImageFe
     refine_mask(1,2) = 1;
     adjuster->setRefinementMask(refine_mask);
 
-    (*adjuster)(features, pairwise_matches, cameras);
+    if(adjust_max_iterations <= 0 && adjust_max_ms <= 0)
+    {
+        (*adjuster)(features, pairwise_matches, cameras);
+    }
+    else
+    {
+        // Run the adjuster in chunks of adjust_chunk_iterations, each warm started from the previous chunk,
+        // and stop on the iteration or wall clock budget or when the reprojection error stops improving
+        TermCriteria saved_criteria = adjuster->termCriteria();
+        int64 start = getTickCount();
+        int iterations = 0;
+        double error = compute_reprojection_error(features, pairwise_matches, cameras);
+
+        while(true)
+        {
+            int chunk = adjust_chunk_iterations;
+            if(adjust_max_iterations > 0)
+                chunk = min(chunk, adjust_max_iterations - iterations);
+            if(chunk <= 0)
+                break;
+
+            vector<CameraParams> backup;
+            for (size_t i = 0; i < cameras.size(); ++i)
+            {
+                backup.push_back(cameras[i]);
+                backup[i].R = cameras[i].R.clone();
+            }
+
+            adjuster->setTermCriteria(TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, chunk, DBL_EPSILON));
+            if(!(*adjuster)(features, pairwise_matches, cameras))
+            {
+                STICHER_DBG_ERR("bundle adjustment failed, keep previous camera params");
+                cameras = backup;
+                break;
+            }
+            iterations += chunk;
+
+            double new_error = compute_reprojection_error(features, pairwise_matches, cameras);
+            double elapsed_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+            STICHER_DBG_OUT("bundle adjustment " << iterations << " iterations, " << elapsed_ms << " ms, reprojection error " << new_error);
+
+            if(new_error > error)
+            {
+                cameras = backup;
+                break;
+            }
+            if(error - new_error < adjust_min_error_delta)
+                break;
+            if(adjust_max_ms > 0 && elapsed_ms >= adjust_max_ms)
+                break;
+            error = new_error;
+        }
+
+        adjuster->setTermCriteria(saved_criteria);
+    }
 
     vector<Mat> rmats;
     for (size_t i = 0; i < cameras.size(); ++i)
@@ -106,11 +867,54 @@ vector<CameraParams> Basic_stitcher::estimate_camera_params(const vector<ImageFe
     waveCorrect(rmats, detail::WAVE_CORRECT_HORIZ);
     for (size_t i = 0; i < cameras.size(); ++i)
         cameras[i].R = rmats[i];
+}
 
-    return cameras;
+double Basic_stitcher::compute_reprojection_error(const vector<ImageFeatures> &features, const vector<MatchesInfo> &pairwise_matches, const vector<CameraParams> &cameras)
+{
+    // RMS distance in pixels between every inlier keypoint and its match mapped through K_j * R_j^T * R_i * K_i^-1
+    double error_sum = 0;
+    int count = 0;
+
+    for(int k = 0; k < pairwise_matches.size(); k++)
+    {
+        const MatchesInfo &info = pairwise_matches[k];
+        int i = info.src_img_idx;
+        int j = info.dst_img_idx;
+        if(i < 0 || j < 0 || i >= j || info.confidence < 1.0)
+            continue;
+
+        Mat_<double> K_i, K_j, R_i, R_j;
+        cameras[i].K().convertTo(K_i, CV_64F);
+        cameras[j].K().convertTo(K_j, CV_64F);
+        cameras[i].R.convertTo(R_i, CV_64F);
+        cameras[j].R.convertTo(R_j, CV_64F);
+        Mat_<double> H = K_j * R_j.t() * R_i * K_i.inv();
+
+        for(int m = 0; m < info.matches.size(); m++)
+        {
+            if(!info.inliers_mask[m])
+                continue;
+
+            Point2f p = features[i].keypoints[info.matches[m].queryIdx].pt;
+            Point2f q = features[j].keypoints[info.matches[m].trainIdx].pt;
+            double z = H(2,0) * p.x + H(2,1) * p.y + H(2,2);
+            if(std::abs(z) < 1e-12)
+                continue;
+            double x = (H(0,0) * p.x + H(0,1) * p.y + H(0,2)) / z;
+            double y = (H(1,0) * p.x + H(1,1) * p.y + H(1,2)) / z;
+
+            error_sum += (x - q.x) * (x - q.x) + (y - q.y) * (y - q.y);
+            count++;
+        }
+    }
+
+    if(count == 0)
+        return 0;
+
+    return sqrt(error_sum / count);
 }
 
-void Basic_stitcher::warping_for_prepare_composition(const vector<Mat> &images, const vector<CameraParams> &cameras, vector<Point> &corners_out, vector<UMat> &warped_out, vector<UMat> &warped_mask_out, vector<Rect> &rois_out)
+float Basic_stitcher::get_warped_image_scale(const vector<CameraParams> &cameras)
 {
     vector<double> focals;
     for (size_t i = 0; i < cameras.size(); ++i)
@@ -125,118 +929,261 @@ void Basic_stitcher::warping_for_prepare_composition(const vector<Mat> &images,
     else
         warped_image_scale = static_cast<float>(focals[focals.size() / 2 - 1] + focals[focals.size() / 2]) * 0.5f;
 
-    int num_images = images.size();
-    vector<Point> corners(num_images);
-    vector<UMat> masks_warped(num_images);
-    vector<UMat> images_warped(num_images);
-    vector<Size> sizes(num_images);
-    vector<UMat> masks(num_images);
-    vector<Rect> rois(num_images);
+    return warped_image_scale;
+}
 
-    for (int i = 0; i < num_images; ++i)
+vector<vector<Rect> > Basic_stitcher::predict_overlap_rois(const vector<Size> &work_sizes)
+{
+    // Warp a full mask of every camera with the previous calibration at seam scale, intersect it with the
+    // masks of its topology neighbours and map each overlap band back into the camera's work scale image
+    int num_images = work_sizes.size();
+    vector<vector<Rect> > overlap_rois(num_images);
+    if(cameras.size() != num_images)
+        return overlap_rois;
+
+    float warped_image_scale = get_warped_image_scale(cameras);
+    vector<Ptr<RotationWarper> > warpers(num_images);
+    vector<Mat_<float> > Ks(num_images);
+    vector<Size> mask_sizes(num_images);
+    vector<UMat> masks_warped(num_images);
+    vector<Rect> rois(num_images);
+
+    for(int i = 0; i < num_images; i++)
+    {
+        float swa = (float)seam_work_aspect[i];
+        warpers[i] = warper_creator->create(warped_image_scale * swa);
+
+        cameras[i].K().convertTo(Ks[i], CV_32F);
+        Ks[i](0,0) *= swa; Ks[i](0,2) *= swa;
+        Ks[i](1,1) *= swa; Ks[i](1,2) *= swa;
+
+        mask_sizes[i] = Size(cvRound(work_sizes[i].width * swa), cvRound(work_sizes[i].height * swa));
+        UMat mask(mask_sizes[i], CV_8U, Scalar::all(255));
+        Point corner = warpers[i]->warp(mask, Ks[i], cameras[i].R, INTER_NEAREST, BORDER_CONSTANT, masks_warped[i]);
+        rois[i] = Rect(corner, masks_warped[i].size());
+    }
+
+    Mat_<uchar> neighbours = make_match_mask(num_images);
+    for(int i = 0; i < num_images; i++)
     {
-        masks[i].create(images[i].size(), CV_8U);
-        masks[i].setTo(Scalar::all(255));
+        double to_work = 1.0 / seam_work_aspect[i];
+        Rect work_rect(Point(0, 0), work_sizes[i]);
+        vector<Rect> bands;
+
+        for(int j = 0; j < num_images; j++)
+        {
+            if(!neighbours(i, j))
+                continue;
+            Rect overlap = rois[i] & rois[j];
+            if(overlap.area() == 0)
+                continue;
+
+            Mat overlap_warped = Mat::zeros(rois[i].size(), CV_8U);
+            Mat mask_i = masks_warped[i].getMat(ACCESS_READ);
+            Mat mask_j = masks_warped[j].getMat(ACCESS_READ);
+            bitwise_and(mask_i(overlap - rois[i].tl()), mask_j(overlap - rois[j].tl()), overlap_warped(overlap - rois[i].tl()));
+
+            Mat overlap_src;
+            warpers[i]->warpBackward(overlap_warped, Ks[i], cameras[i].R, INTER_NEAREST, BORDER_CONSTANT, mask_sizes[i], overlap_src);
+
+            vector<Point> points;
+            findNonZero(overlap_src, points);
+            if(points.empty())
+                continue;
+            Rect band = boundingRect(points);
+
+            Rect band_work(cvFloor(band.x * to_work) - overlap_margin, cvFloor(band.y * to_work) - overlap_margin
+                         , cvCeil(band.width * to_work) + 2 * overlap_margin, cvCeil(band.height * to_work) + 2 * overlap_margin);
+            band_work &= work_rect;
+            if(band_work.area() > 0)
+                bands.push_back(band_work);
+        }
+
+        // merge intersecting bands so no region is detected twice
+        bool merged = true;
+        while(merged)
+        {
+            merged = false;
+            for(int a = 0; a < bands.size() && !merged; a++)
+            {
+                for(int b = a + 1; b < bands.size() && !merged; b++)
+                {
+                    if((bands[a] & bands[b]).area() > 0)
+                    {
+                        bands[a] |= bands[b];
+                        bands.erase(bands.begin() + b);
+                        merged = true;
+                    }
+                }
+            }
+        }
+
+        overlap_rois[i] = bands;
     }
 
+    return overlap_rois;
+}
+
+void Basic_stitcher::build_warp_maps(const vector<Mat> &images, const vector<CameraParams> &cameras, const vector<double> &dst_work_aspect, vector<warp_maps> &maps, double src_scale)
+{
+    // The maps sample the given (full resolution) images directly, K is rescaled from work scale to their size.
+    // src_scale is the size of the sampled images relative to the ones the scales were computed for.
+    float warped_image_scale = get_warped_image_scale(cameras);
+    int num_images = images.size();
+    maps.resize(num_images);
+
     for (int i = 0; i < num_images; ++i)
     {
-        Ptr<RotationWarper> warper = warper_creator->create(static_cast<float>(warped_image_scale) * static_cast<float>(seam_work_aspect[i]));
-        
+        Ptr<RotationWarper> warper = warper_creator->create(warped_image_scale * static_cast<float>(dst_work_aspect[i]));
+
         Mat_<float> K;
         cameras[i].K().convertTo(K, CV_32F);
-        float swa = (float)seam_work_aspect[i];
+        float swa = (float)(src_scale / work_scale[i]);
         K(0,0) *= swa; K(0,2) *= swa;
         K(1,1) *= swa; K(1,2) *= swa;
 
-        corners[i] = warper->warp(images[i], K, cameras[i].R, INTER_LINEAR, BORDER_REFLECT, images_warped[i]);
-        sizes[i] = images_warped[i].size();
+        Rect roi = warper->buildMaps(images[i].size(), K, cameras[i].R, maps[i].xmap, maps[i].ymap);
+        maps[i].roi = Rect(roi.tl(), maps[i].xmap.size());
+        maps[i].src_size = images[i].size();
+
+        UMat mask(images[i].size(), CV_8U, Scalar::all(255));
+        remap(mask, maps[i].mask, maps[i].xmap, maps[i].ymap, INTER_NEAREST, BORDER_CONSTANT);
+    }
+}
+
+bool Basic_stitcher::warp_maps_valid(const vector<Mat> &images, const vector<warp_maps> &maps, int maps_version)
+{
+    if(maps_version != cameras_version || maps.size() != images.size())
+        return false;
+
+    for (int i = 0; i < images.size(); ++i)
+    {
+        if(maps[i].src_size != images[i].size())
+            return false;
+    }
 
-        warper->warp(masks[i], K, cameras[i].R, INTER_NEAREST, BORDER_CONSTANT, masks_warped[i]);
+    return true;
+}
 
-        rois[i] = warper->warpRoi(images[i].size(), K, cameras[i].R);
+void Basic_stitcher::warping_for_prepare_composition(const vector<Mat> &images, const vector<CameraParams> &cameras, vector<Point> &corners_out, vector<UMat> &warped_out, vector<UMat> &warped_mask_out, vector<Rect> &rois_out)
+{
+    if(!warp_maps_valid(images, prepare_maps, prepare_maps_version))
+    {
+        STICHER_DBG_OUT("building seam scale warp maps");
+        build_warp_maps(images, cameras, seam_work_aspect, prepare_maps);
+        prepare_maps_version = cameras_version;
     }
-    
+
+    int num_images = images.size();
     for (int i = 0; i < num_images; ++i)
     {
-        corners_out.push_back(corners[i]);
-        warped_out.push_back(images_warped[i]);
-        warped_mask_out.push_back(masks_warped[i]);
-        rois_out.push_back(rois[i]);
+        UMat image_warped;
+        remap(images[i], image_warped, prepare_maps[i].xmap, prepare_maps[i].ymap, INTER_LINEAR, BORDER_REFLECT);
+
+        // the seam finder cuts the masks in place, so hand out a copy of the cached one
+        corners_out.push_back(prepare_maps[i].roi.tl());
+        warped_out.push_back(image_warped);
+        warped_mask_out.push_back(prepare_maps[i].mask.clone());
+        rois_out.push_back(prepare_maps[i].roi);
     }
 }
 
-void Basic_stitcher::warping_for_composition(const vector<Mat> &images, const vector<CameraParams> &cameras, vector<Point> &corners_out, vector<UMat> &warped_out, vector<UMat> &warped_mask_out, vector<Rect> &rois_out)
+void Basic_stitcher::update_compose_maps(const vector<Mat> &images, const vector<CameraParams> &cameras)
 {
-    vector<double> focals;
-    for (size_t i = 0; i < cameras.size(); ++i)
+    if(!compose_maps_yuv && warp_maps_valid(images, compose_maps, compose_maps_version))
+        return;
+
+    STICHER_DBG_OUT("building compose scale warp maps");
+    build_warp_maps(images, cameras, compose_work_aspect, compose_maps);
+    compose_maps_version = cameras_version;
+    compose_maps_yuv = false;
+
+    vector<Point> corners;
+    vector<Size> sizes;
+    for (int i = 0; i < compose_maps.size(); ++i)
     {
-        focals.push_back(cameras[i].focal);
+        corners.push_back(compose_maps[i].roi.tl());
+        sizes.push_back(compose_maps[i].roi.size());
     }
-    sort(focals.begin(), focals.end());
+    pano_rect = resultRoi(corners, sizes);
+}
 
-    float warped_image_scale;
-    if (focals.size() % 2 == 1)
-        warped_image_scale = static_cast<float>(focals[focals.size() / 2]);
-    else
-        warped_image_scale = static_cast<float>(focals[focals.size() / 2 - 1] + focals[focals.size() / 2]) * 0.5f;
+void Basic_stitcher::warping_for_composition(const vector<Mat> &images, const vector<CameraParams> &cameras, vector<Point> &corners_out, vector<UMat> &warped_out, vector<UMat> &warped_mask_out, vector<Rect> &rois_out)
+{
+    update_compose_maps(images, cameras);
 
     int num_images = images.size();
-    vector<Point> corners(num_images);
-    vector<UMat> masks_warped(num_images);
-    vector<UMat> images_warped(num_images);
-    vector<Size> sizes(num_images);
-    vector<UMat> masks(num_images);
-    vector<Rect> rois(num_images);
-    vector<CameraParams> cameras_;
-    cameras_ = cameras;
-
     for (int i = 0; i < num_images; ++i)
     {
-        masks[i].create(images[i].size(), CV_8U);
-        masks[i].setTo(Scalar::all(255));
+        UMat image_warped;
+        remap(images[i], image_warped, compose_maps[i].xmap, compose_maps[i].ymap, INTER_LINEAR, BORDER_REFLECT);
+
+        corners_out.push_back(compose_maps[i].roi.tl());
+        warped_out.push_back(image_warped);
+        warped_mask_out.push_back(compose_maps[i].mask);
+        rois_out.push_back(compose_maps[i].roi);
     }
+}
 
+void Basic_stitcher::finding_seam(vector<Point> &corners, vector<UMat> &warped, vector<UMat> &warped_mask)
+{
+    // A seam finder only changes mask pixels inside overlaps, so each image is cropped to the bounding box of
+    // its overlaps (plus the graph cut gap) and images that overlap nothing are left out. Only the graph cut
+    // finders need CV_32F input (the parallel one converts per pair), Dp takes CV_8UC3 and Voronoi never
+    // reads the pixels.
+    const int gap = 10;
+    int num_images = warped.size();
+    vector<Rect> rects(num_images);
     for (int i = 0; i < num_images; ++i)
-    {
-        Ptr<RotationWarper> warper = warper_creator->create(static_cast<float>(warped_image_scale) * static_cast<float>(compose_work_aspect[i]));
-        
-        Mat_<float> K;
-        cameras_[i].K().convertTo(K, CV_32F);
-        cameras_[i].focal *= compose_work_aspect[i];
-        cameras_[i].ppx *= compose_work_aspect[i];
-        cameras_[i].ppy *= compose_work_aspect[i];
+        rects[i] = Rect(corners[i], warped[i].size());
 
-        Size sz = images[i].size();
-        if (std::abs(compose_scale[i] - 1) > 1e-1)
+    vector<int> indices;
+    vector<Rect> crops;
+    for (int i = 0; i < num_images; ++i)
+    {
+        Rect bound;
+        for (int j = 0; j < num_images; ++j)
         {
-            sz.width = cvRound(images[i].size().width * compose_scale[i]);
-            sz.height = cvRound(images[i].size().height * compose_scale[i]);
+            Rect overlap = rects[i] & rects[j];
+            if (j == i || overlap.area() == 0)
+                continue;
+            bound = (bound.area() == 0) ? overlap : (bound | overlap);
         }
-        rois[i] = warper->warpRoi(sz, K, cameras_[i].R);
+        if (bound.area() == 0)
+            continue;
 
-        corners[i] = warper->warp(images[i], K, cameras_[i].R, INTER_LINEAR, BORDER_REFLECT, images_warped[i]);
-        sizes[i] = images_warped[i].size();
-
-        warper->warp(masks[i], K, cameras_[i].R, INTER_NEAREST, BORDER_CONSTANT, masks_warped[i]);
+        bound = Rect(bound.x - gap, bound.y - gap, bound.width + 2 * gap, bound.height + 2 * gap) & rects[i];
+        indices.push_back(i);
+        crops.push_back(bound);
     }
-    
-    for (int i = 0; i < num_images; ++i)
+    if (indices.size() < 2)
+        return;
+
+    bool need_float = (seam_finder_type == SEAM_GRAPHCUT_COLOR || seam_finder_type == SEAM_GRAPHCUT_COLOR_GRAD);
+    vector<UMat> images_crop(indices.size());
+    vector<UMat> masks_crop(indices.size());
+    vector<Point> corners_crop(indices.size());
+    for (int k = 0; k < indices.size(); ++k)
     {
-        corners_out.push_back(corners[i]);
-        warped_out.push_back(images_warped[i]);
-        warped_mask_out.push_back(masks_warped[i]);
-        rois_out.push_back(rois[i]);
+        int i = indices[k];
+        Rect local = crops[k] - corners[i];
+        if (need_float)
+            warped[i](local).convertTo(images_crop[k], CV_32F);
+        else if (seam_finder_type != SEAM_VORONOI && seam_finder_type != SEAM_NO)
+            images_crop[k] = warped[i](local);
+        else
+            images_crop[k] = UMat(local.size(), warped[i].type());
+        warped_mask[i](local).copyTo(masks_crop[k]);
+        corners_crop[k] = crops[k].tl();
     }
-}
 
-void Basic_stitcher::finding_seam(vector<Point> &corners, vector<UMat> &warped, vector<UMat> &warped_mask)
-{
-    vector<UMat> images_warped_f(warped.size());
-    for (int i = 0; i < warped.size(); ++i)
-        warped[i].convertTo(images_warped_f[i], CV_32F);
+    seam_finder->find(images_crop, corners_crop, masks_crop);
 
-    seam_finder->find(images_warped_f, corners, warped_mask);
+    for (int k = 0; k < indices.size(); ++k)
+    {
+        int i = indices[k];
+        masks_crop[k].copyTo(warped_mask[i](crops[k] - corners[i]));
+    }
 }
 
 void Basic_stitcher::feeding_exposure_compensator(vector<Point> &corners, vector<UMat> &images_warped, vector<UMat> &masks_warped)
@@ -279,23 +1226,42 @@ Mat Basic_stitcher::blending(vector<UMat> &image_warped, vector<Rect> &rois, vec
 
 void Basic_stitcher::calculate_camera_params(vector<Mat> &full_img)
 {
+    recalibration_requested = false;
+    drift_baseline = -1;
+    bool has_previous = (cameras.size() == full_img.size());
+
     STICHER_DBG_OUT("resize full images to working size images");
-    vector<Mat> imgs;
-    for(int i = 0; i < full_img.size(); i++)
+    vector<Mat> imgs = get_scaled_images(full_img, work_scale);
+
+    vector<vector<Rect> > rois;
+    if(overlap_features && has_previous)
     {
-        Mat resized;
-        resize(full_img[i], resized, Size(), work_scale[i], work_scale[i], INTER_LINEAR_EXACT);
-        imgs.push_back(resized);
+        STICHER_DBG_OUT("predicting overlap bands from previous camera params");
+        vector<Size> work_sizes;
+        for(int i = 0; i < imgs.size(); i++)
+            work_sizes.push_back(imgs[i].size());
+        rois = predict_overlap_rois(work_sizes);
     }
 
     STICHER_DBG_OUT("finding_features");
-    features = finding_features(imgs);
+    features = finding_features(imgs, rois);
 
     STICHER_DBG_OUT("pairwise_matching");
     pairwise_matches = pairwise_matching(features);
 
-    STICHER_DBG_OUT("estimate_camera_params");
-    cameras = estimate_camera_params(features, pairwise_matches);
+    cameras_version++;
+    if(seam_finder_type == SEAM_TEMPORAL)
+        seam_finder.dynamicCast<Temporal_seam_finder>()->reset();
+    if(adjust_warm_start && has_previous)
+    {
+        STICHER_DBG_OUT("refine_camera_params from previous camera params");
+        cameras = refine_camera_params(features, pairwise_matches, cameras);
+    }
+    else
+    {
+        STICHER_DBG_OUT("estimate_camera_params");
+        cameras = estimate_camera_params(features, pairwise_matches);
+    }
 }
 
 vector<CameraParams> Basic_stitcher::get_camera_params()
@@ -306,76 +1272,882 @@ vector<CameraParams> Basic_stitcher::get_camera_params()
 void Basic_stitcher::set_camera_params(vector<CameraParams> &cameras_)
 {
     cameras = cameras_;
+    cameras_version++;
+    recalibration_requested = false;
+    drift_baseline = -1;
+
+    // seams of the old cameras are no start for the new ones, even when the warped rectangles stay the same
+    if(seam_finder_type == SEAM_TEMPORAL)
+        seam_finder.dynamicCast<Temporal_seam_finder>()->reset();
 }
 
-void Basic_stitcher::prepare_compose(std::vector<cv::Mat> &full_img)
+bool Basic_stitcher::save_camera_params(const string &file)
 {
-    STICHER_DBG_OUT("resize full images to seam scale size images");
-    vector<Mat> imgs;
-    for(int i = 0; i < full_img.size(); i++)
+    FileStorage fs(file, FileStorage::WRITE);
+    if(!fs.isOpened())
     {
-        Mat resized;
-        resize(full_img[i], resized, Size(), seam_scale[i], seam_scale[i], INTER_LINEAR_EXACT);
-        imgs.push_back(resized);
+        STICHER_DBG_ERR("can not write " << file);
+        return false;
     }
 
-    STICHER_DBG_OUT("warping for finding seam and exposure compensation");
-    warping_for_prepare_composition(imgs, cameras, corners_prepare, warped_prepare, warped_mask_prepare, rois_prepare);
+    fs << "work_megapix" << work_megapix;
+    fs << "cameras" << "[";
+    for(int i = 0; i < cameras.size(); i++)
+    {
+        fs << "{" << "focal" << cameras[i].focal << "aspect" << cameras[i].aspect
+           << "ppx" << cameras[i].ppx << "ppy" << cameras[i].ppy
+           << "R" << cameras[i].R << "t" << cameras[i].t << "}";
+    }
+    fs << "]";
+
+    return true;
+}
+
+bool Basic_stitcher::load_camera_params(const string &file)
+{
+    FileStorage fs(file, FileStorage::READ);
+    if(!fs.isOpened())
+    {
+        STICHER_DBG_ERR("can not read " << file);
+        return false;
+    }
+
+    double saved_megapix = (double)fs["work_megapix"];
+    if(std::abs(saved_megapix - work_megapix) > 1e-9)
+    {
+        STICHER_DBG_ERR("camera params of " << file << " are for work megapix " << saved_megapix);
+        return false;
+    }
+
+    vector<CameraParams> loaded;
+    FileNode nodes = fs["cameras"];
+    for(FileNodeIterator it = nodes.begin(); it != nodes.end(); ++it)
+    {
+        CameraParams camera;
+        (*it)["focal"] >> camera.focal;
+        (*it)["aspect"] >> camera.aspect;
+        (*it)["ppx"] >> camera.ppx;
+        (*it)["ppy"] >> camera.ppy;
+        (*it)["R"] >> camera.R;
+        (*it)["t"] >> camera.t;
+        loaded.push_back(camera);
+    }
+    if(loaded.empty())
+        return false;
+
+    set_camera_params(loaded);
+    return true;
+}
+
+vector<Mat> Basic_stitcher::get_scaled_images(vector<Mat> &full_img, const vector<double> &scales)
+{
+    vector<Mat> imgs(full_img.size());
+    parallel_for_(Range(0, (int)full_img.size()), [&](const Range &range)
+    {
+        for(int i = range.start; i < range.end; i++)
+            resize(full_img[i], imgs[i], Size(), scales[i], scales[i], INTER_LINEAR_EXACT);
+    });
+
+    return imgs;
+}
+
+void Basic_stitcher::prepare_compose(std::vector<cv::Mat> &full_img)
+{
+    STICHER_DBG_OUT("warping full images to seam scale for finding seam and exposure compensation");
+    corners_prepare.clear();
+    warped_prepare.clear();
+    warped_mask_prepare.clear();
+    rois_prepare.clear();
+    warping_for_prepare_composition(full_img, cameras, corners_prepare, warped_prepare, warped_mask_prepare, rois_prepare);
     
     STICHER_DBG_OUT("feeding with seam scale resized images");
     feeding_exposure_compensator(corners_prepare, warped_prepare, warped_mask_prepare);
 
     STICHER_DBG_OUT("finding_seam");
     finding_seam(corners_prepare, warped_prepare, warped_mask_prepare);
+    update_seams_version();
+    update_gains_version();
 }
 
-void Basic_stitcher::compose(vector<Mat> &full_img)
+void Basic_stitcher::update_gains_version()
 {
-    STICHER_DBG_OUT("resize full images to compose scale size images");
-    vector<Mat> imgs;
+    // Same for the exposure gains: they are read at seam scale, and gains_version only moves once a gain is
+    // more than gain_tolerance off the one the maps were last built with, so the compose scale gain maps and
+    // the weights they are folded into are kept while the light is steady. Re-estimated gains jitter slightly
+    // every frame, the tolerance is below what shows in 8-bit output.
+    const double gain_tolerance = 1.0 / 512;
+    bool same = (gain_probes_prev.size() == warped_mask_prepare.size());
+    vector<Mat> probes;
+    for(int i = 0; i < warped_mask_prepare.size(); i++)
+    {
+        Mat gain = exposure_gain(i, corners_prepare[i], warped_mask_prepare[i].size(), prepare_maps[i].mask);
+        same = same && gain.size() == gain_probes_prev[i].size() && norm(gain, gain_probes_prev[i], NORM_INF) <= gain_tolerance;
+        probes.push_back(gain);
+    }
+    if(same)
+        return;
 
-    for(int i = 0; i < full_img.size(); i++)
+    gain_probes_prev = probes;
+    gains_version++;
+}
+
+void Basic_stitcher::update_seams_version()
+{
+    // With a fixed rig the seams of consecutive frames usually come out the same. They are compared here at
+    // seam scale, where it is cheap, and seams_version only moves when they changed, so the compose scale
+    // blend masks and everything derived from them are not rebuilt every frame.
+    bool same = (seam_masks_prev.size() == warped_mask_prepare.size());
+    for(int i = 0; same && i < warped_mask_prepare.size(); i++)
     {
-        if (abs(compose_scale[i] - 1) > 1e-1)
-        {
-            Mat resized;
-            resize(full_img[i], resized, Size(), compose_scale[i], compose_scale[i], INTER_LINEAR_EXACT);
-            imgs.push_back(resized);
-        }
-        else
-        {
-            imgs.push_back(full_img[i]);
-        }
+        Mat mask = warped_mask_prepare[i].getMat(ACCESS_READ);
+        same = (corners_prepare[i] == seam_corners_prev[i] && mask.size() == seam_masks_prev[i].size()
+                && countNonZero(mask != seam_masks_prev[i]) == 0);
     }
+    if(same)
+        return;
+
+    seam_masks_prev.clear();
+    for(int i = 0; i < warped_mask_prepare.size(); i++)
+        seam_masks_prev.push_back(warped_mask_prepare[i].getMat(ACCESS_READ).clone());
+    seam_corners_prev = corners_prepare;
+    seams_version++;
+}
+
+void Basic_stitcher::compose(vector<Mat> &full_img)
+{
+    STICHER_DBG_OUT("warping full images to compose scale");
+    corners_compose.clear();
+    warped_compose.clear();
+    warped_mask_compose.clear();
+    rois_compose.clear();
+    warping_for_composition(full_img, cameras, corners_compose, warped_compose, warped_mask_compose, rois_compose);
 
-    STICHER_DBG_OUT("warping for composition");
-    warping_for_composition(imgs, cameras, corners_compose, warped_compose, warped_mask_compose, rois_compose);
+    if(blend_type == BLEND_FEATHER_MAPS)
+    {
+        STICHER_DBG_OUT("blending with precomputed feather weights and gains");
+        result = blend_feather_maps(warped_compose, rois_compose);
+        update_outputs();
+        return;
+    }
 
     STICHER_DBG_OUT("applying exposure compensation gain");
     vector<Point> corner_roi;
-    for(int i = 0; i < imgs.size(); i++)
+    for(int i = 0; i < full_img.size(); i++)
         corner_roi.push_back(rois_compose[i].tl());
     applying_exposure_compensator(corner_roi, warped_compose, warped_mask_compose);
 
     STICHER_DBG_OUT("blending");
-    vector<UMat> mask_warped_;
-    for(int i = 0; i < imgs.size(); i++)
+    update_blend_masks();
+    result = blending(warped_compose, rois_compose, blend_masks);
+    update_outputs();
+}
+
+void Basic_stitcher::set_output_scales(const vector<double> &scales)
+{
+    output_scales = scales;
+}
+
+void Basic_stitcher::update_outputs()
+{
+    // Lower resolutions come from one Gaussian pyramid of the blended panorama, which is what collapsing
+    // the multi-band Laplacian pyramid down to that level gives (MultiBandBlender keeps its levels private).
+    // Every output resamples the nearest level at least as large as itself.
+    outputs.clear();
+    outputs.push_back(result);
+    if(output_scales.empty() || result.empty())
+        return;
+
+    vector<Mat> pyramid(1, result);
+    vector<double> pyramid_scale(1, 1.0);
+    for(int k = 0; k < output_scales.size(); k++)
+    {
+        double scale = output_scales[k];
+        Size sz(max(1, cvRound(result.cols * scale)), max(1, cvRound(result.rows * scale)));
+
+        while(pyramid_scale.back() * 0.5 >= scale && pyramid.back().cols > 1 && pyramid.back().rows > 1)
+        {
+            Mat down;
+            pyrDown(pyramid.back(), down);
+            pyramid.push_back(down);
+            pyramid_scale.push_back(pyramid_scale.back() * 0.5);
+        }
+
+        int level = 0;
+        while(level + 1 < pyramid.size() && pyramid_scale[level + 1] >= scale)
+            level++;
+
+        Mat out;
+        if(pyramid[level].size() == sz)
+            out = pyramid[level];
+        else
+            resize(pyramid[level], out, sz, 0, 0, INTER_AREA);
+        outputs.push_back(out);
+    }
+}
+
+vector<Mat> Basic_stitcher::get_outputs()
+{
+    return outputs;
+}
+
+void Basic_stitcher::update_blend_masks()
+{
+    // compose scale seam masks, rebuilt only when the seams or the compose maps changed
+    bool valid = (blend_masks_version == seams_version && blend_masks.size() == compose_maps.size());
+    for(int i = 0; valid && i < compose_maps.size(); i++)
+        valid = (blend_masks[i].size() == compose_maps[i].roi.size());
+    if(valid)
+        return;
+
+    blend_masks.clear();
+    for(int i = 0; i < compose_maps.size(); i++)
     {
         Mat dilated_mask;
         Mat seam_mask;
         Mat warped_mask_compose_;
-        warped_mask_compose[i].copyTo(warped_mask_compose_);
+        compose_maps[i].mask.copyTo(warped_mask_compose_);
         Mat mask_warped_tmp;
 
         dilate(warped_mask_prepare[i], dilated_mask, Mat());
-        resize(dilated_mask, seam_mask, warped_mask_compose[i].size(), 0, 0, INTER_LINEAR_EXACT);
+        resize(dilated_mask, seam_mask, warped_mask_compose_.size(), 0, 0, INTER_LINEAR_EXACT);
 
         mask_warped_tmp = seam_mask & warped_mask_compose_;
         UMat tmp;
         mask_warped_tmp.copyTo(tmp);
-        mask_warped_.push_back(tmp);
+        blend_masks.push_back(tmp);
+    }
+    blend_masks_version = seams_version;
+}
+
+void Basic_stitcher::update_gain_maps()
+{
+    // Per pixel gain of every camera at compose scale, so regions can be compensated without the compensator
+    // seeing the whole warped image
+    bool valid = (gain_maps_version == gains_version && gain_maps.size() == compose_maps.size());
+    for(int i = 0; valid && i < compose_maps.size(); i++)
+        valid = (gain_maps[i].size() == compose_maps[i].roi.size());
+    if(valid)
+        return;
+
+    gain_maps.clear();
+    for(int i = 0; i < compose_maps.size(); i++)
+        gain_maps.push_back(exposure_gain(i, compose_maps[i].roi.tl(), compose_maps[i].roi.size(), compose_maps[i].mask));
+    gain_maps_version = gains_version;
+}
+
+Mat Basic_stitcher::exposure_gain(int idx, Point corner, Size size, const UMat &mask)
+{
+    // CV_32F gain of camera idx over a size area. Plain gains are read directly. The block compensator only
+    // applies to CV_8UC3, so it is probed with a constant image of 255, 128 and 32 in the three channels:
+    // the brightest channel that did not saturate gives the gain to half a step of 1/255 below 1, 1/128
+    // below 2 and 1/32 above.
+    if(compensator.dynamicCast<NoExposureCompensator>())
+        return Mat(size, CV_32F, Scalar::all(1));
+    Ptr<GainCompensator> gain_compensator = compensator.dynamicCast<GainCompensator>();
+    if(gain_compensator)
+        return Mat(size, CV_32F, Scalar::all(gain_compensator->gains()[idx]));
+
+    UMat probe(size, CV_8UC3, Scalar(255, 128, 32));
+    compensator->apply(idx, corner, probe, mask);
+
+    Mat_<Vec3b> probed = probe.getMat(ACCESS_READ);
+    Mat_<float> gain(size);
+    for(int y = 0; y < size.height; y++)
+    {
+        const Vec3b* p = probed[y];
+        float* g = gain[y];
+        for(int x = 0; x < size.width; x++)
+        {
+            if(p[x][0] < 255)
+                g[x] = p[x][0] / 255.f;
+            else if(p[x][1] < 255)
+                g[x] = p[x][1] / 128.f;
+            else
+                g[x] = p[x][2] / 32.f;
+        }
+    }
+    return gain;
+}
+
+void Basic_stitcher::make_feather_weights(Point origin, Size size, vector<Mat> &weights)
+{
+    // feather weights of the blend masks as FeatherBlender makes them, normalized here once instead of
+    // per pixel per frame; rois are the compose map ones relative to origin, inside size
+    weights.assign(compose_maps.size(), Mat());
+    Mat weight_sum = Mat::zeros(size, CV_32F);
+    for(int i = 0; i < compose_maps.size(); i++)
+    {
+        createWeightMap(blend_masks[i].getMat(ACCESS_READ), 0.02f, weights[i]);
+        Mat sum_roi = weight_sum(compose_maps[i].roi - origin);
+        sum_roi += weights[i];
+    }
+    for(int i = 0; i < compose_maps.size(); i++)
+        divide(weights[i], weight_sum(compose_maps[i].roi - origin) + 1e-5f, weights[i]);
+}
+
+void Basic_stitcher::update_feather_weights()
+{
+    // Nothing here runs per frame unless the seams, the cameras or the gains changed: the weights (a distance
+    // transform per camera) follow the seams and rois, the gains are refolded only when they moved
+    update_blend_masks();
+    update_gain_maps();
+
+    bool valid = (feather_seams_version == seams_version && feather_rois.size() == compose_maps.size());
+    for(int i = 0; valid && i < compose_maps.size(); i++)
+        valid = (compose_maps[i].roi == feather_rois[i]);
+    if(!valid)
+    {
+        STICHER_DBG_OUT("building feather weight maps");
+        make_feather_weights(pano_rect.tl(), pano_rect.size(), feather_weights);
+        feather_rois.clear();
+        for(int i = 0; i < compose_maps.size(); i++)
+            feather_rois.push_back(compose_maps[i].roi);
+        feather_seams_version = seams_version;
+        feather_gains_version = -1;
+    }
+
+    // exposure gains are folded into the weights, so blending is one multiply-add per pixel and camera
+    if(feather_gains_version != gain_maps_version)
+    {
+        feather_gained.resize(compose_maps.size());
+        for(int i = 0; i < compose_maps.size(); i++)
+            multiply(feather_weights[i], gain_maps[i], feather_gained[i]);
+        feather_gains_version = gain_maps_version;
     }
-    result = blending(warped_compose, rois_compose, mask_warped_);
+}
+
+Mat Basic_stitcher::blend_feather_maps(vector<UMat> &image_warped, vector<Rect> &rois)
+{
+    update_feather_weights();
+
+    Mat acc = Mat::zeros(pano_rect.size(), CV_32FC3);
+    for(int i = 0; i < image_warped.size(); i++)
+    {
+        Mat acc_roi = acc(rois[i] - pano_rect.tl());
+        stitch_kernels::accumulate_weighted<uchar, 3>(image_warped[i].getMat(ACCESS_READ), feather_gained[i], acc_roi);
+    }
+
+    // CV_16SC3 like the Blenders' output
+    Mat out(acc.size(), CV_16SC3);
+    stitch_kernels::store_accumulated<short, 3>(acc, out);
+    return out;
+}
+
+Ptr<Blender> Basic_stitcher::create_blender()
+{
+    // region and tile renders blend through a FeatherBlender, which gives the same weights
+    if(blend_type == BLEND_FEATHER_MAPS)
+        return makePtr<FeatherBlender>();
+
+    Ptr<Blender> new_blender = Blender::createDefault(blend_type, use_cuda);
+
+    MultiBandBlender* mb = dynamic_cast<MultiBandBlender*>(new_blender.get());
+    if(mb)
+        mb->setNumBands(blend_bands);
+
+    return new_blender;
+}
+
+int Basic_stitcher::blend_margin()
+{
+    // pixels outside a region that still reach into it through the blender
+    if(blend_type == Blender::MULTI_BAND)
+        return 2 << blend_bands;
+
+    // feather weights saturate 1 / sharpness pixels inside a mask, so a false mask edge at the region border
+    // further out than that leaves every weight of the region as in the full frame
+    if(blend_type == Blender::FEATHER || blend_type == BLEND_FEATHER_MAPS)
+        return cvCeil(1.0 / FeatherBlender().sharpness()) + 1;
+
+    return 0;
+}
+
+Rect Basic_stitcher::blend_region(Rect rect)
+{
+    // rect plus the blender margin, inside the panorama
+    int margin = blend_margin();
+    Rect region(rect.x - margin, rect.y - margin, rect.width + 2 * margin, rect.height + 2 * margin);
+
+    // multi-band regions start on the pyramid grid of the full panorama, so every level of every region
+    // samples the same pixels as the full frame blend does
+    if(blend_type == Blender::MULTI_BAND)
+    {
+        int grid = 1 << blend_bands;
+        int x = pano_rect.x + cvFloor((region.x - pano_rect.x) / (double)grid) * grid;
+        int y = pano_rect.y + cvFloor((region.y - pano_rect.y) / (double)grid) * grid;
+        region = Rect(x, y, region.br().x - x, region.br().y - y);
+    }
+
+    return region & pano_rect;
+}
+
+Mat Basic_stitcher::compose_rect(vector<Mat> &full_img, Rect rect, bool update_warped)
+{
+    update_compose_maps(full_img, cameras);
+    update_blend_masks();
+    update_gain_maps();
+
+    compose_views views = get_compose_views();
+    return render_rect(full_img, rect, update_warped, views);
+}
+
+Basic_stitcher::compose_views Basic_stitcher::get_compose_views()
+{
+    // host views of the cached UMats, taken once on the calling thread before rendering in parallel
+    compose_views views;
+    for(int i = 0; i < compose_maps.size(); i++)
+    {
+        views.xmap.push_back(compose_maps[i].xmap.getMat(ACCESS_READ));
+        views.ymap.push_back(compose_maps[i].ymap.getMat(ACCESS_READ));
+        views.blend_mask.push_back(blend_masks[i].getMat(ACCESS_READ));
+    }
+    return views;
+}
+
+Mat Basic_stitcher::render_rect(const vector<Mat> &full_img, Rect rect, bool update_warped, const compose_views &views)
+{
+    // Warp, compensate and blend only the source pixels that land in rect (plus the blender margin),
+    // sampling the cached compose maps. Returns a CV_16SC3 image of rect's size, zero outside the panorama.
+    // Only reads the caches unless update_warped is set, so renders of different rects may run concurrently.
+    Mat out = Mat::zeros(rect.size(), CV_16SC3);
+    Rect inner = rect & pano_rect;
+    if(inner.area() == 0)
+        return out;
+
+    Rect region = blend_region(inner);
+
+    Ptr<Blender> region_blender = create_blender();
+    region_blender->prepare(region);
+    bool fed = false;
+
+    for(int i = 0; i < compose_maps.size(); i++)
+    {
+        Rect sub = region & compose_maps[i].roi;
+        if(sub.area() == 0)
+            continue;
+        Rect local = sub - compose_maps[i].roi.tl();
+
+        Mat patch;
+        remap(full_img[i], patch, views.xmap[i](local), views.ymap[i](local), INTER_LINEAR, BORDER_REFLECT);
+        stitch_kernels::apply_gain<uchar, 3>(patch, gain_maps[i](local));
+        if(update_warped && i < warped_compose.size())
+            patch.copyTo(warped_compose[i](local));
+
+        Mat patch_s;
+        patch.convertTo(patch_s, CV_16S);
+        region_blender->feed(patch_s, views.blend_mask[i](local), sub.tl());
+        fed = true;
+    }
+    if(!fed)
+        return out;
+
+    Mat region_result, region_mask;
+    region_blender->blend(region_result, region_mask);
+    region_result(inner - region.tl()).copyTo(out(inner - rect.tl()));
+
+    return out;
+}
+
+void Basic_stitcher::prepare_viewports(vector<Mat> &imgs)
+{
+    update_image_scale(imgs);
+
+    if(need_recalibration())
+    {
+        STICHER_DBG_OUT("----Calcualating CameraParams----");
+        calculate_camera_params(imgs);
+    }
+
+    STICHER_DBG_OUT("----Prepare exposure compensate gains, find seam----");
+    prepare_compose(imgs);
+
+    update_compose_maps(imgs, cameras);
+    update_blend_masks();
+    update_gain_maps();
+}
+
+Rect Basic_stitcher::get_pano_rect()
+{
+    return pano_rect;
+}
+
+vector<Mat> Basic_stitcher::compose_viewports(vector<Mat> &full_img, const vector<Rect> &views)
+{
+    update_compose_maps(full_img, cameras);
+    update_blend_masks();
+    update_gain_maps();
+
+    compose_views cached = get_compose_views();
+    vector<Mat> outputs(views.size());
+    parallel_for_(Range(0, (int)views.size()), [&](const Range &range)
+    {
+        for(int v = range.start; v < range.end; v++)
+            render_rect(full_img, views[v], false, cached).convertTo(outputs[v], CV_8U);
+    });
+
+    return outputs;
+}
+
+Mat Basic_stitcher::compose_viewport(vector<Mat> &full_img, Rect view)
+{
+    return compose_viewports(full_img, vector<Rect>(1, view))[0];
+}
+
+void Rect_spherical_warper::set_camera_params(InputArray K, InputArray R)
+{
+    projector_.setCameraParams(K, R);
+}
+
+void Rect_spherical_warper::build_maps_rect(Rect dst_rect, Mat &xmap, Mat &ymap) const
+{
+    // a private copy of the projector, tiles of one source build their maps concurrently
+    detail::SphericalProjector projector = projector_;
+
+    xmap.create(dst_rect.size(), CV_32F);
+    ymap.create(dst_rect.size(), CV_32F);
+
+    float x, y;
+    for(int v = 0; v < dst_rect.height; v++)
+    {
+        float* xrow = xmap.ptr<float>(v);
+        float* yrow = ymap.ptr<float>(v);
+        for(int u = 0; u < dst_rect.width; u++)
+        {
+            projector.mapBackward(static_cast<float>(dst_rect.x + u), static_cast<float>(dst_rect.y + v), x, y);
+            xrow[u] = x;
+            yrow[u] = y;
+        }
+    }
+}
+
+bool Basic_stitcher::stitch_tiled(const vector<string> &files, Tile_sink &sink, int tile_size, size_t cache_bytes)
+{
+    // Full images are decoded one at a time and only kept at the larger of the work and seam scales
+    STICHER_DBG_OUT("----Reading sources at calibration scale----");
+    int num_images = files.size();
+    vector<Mat> reduced(num_images);
+    vector<Size> full_sizes(num_images);
+    vector<double> reduce_scale(num_images);
+    for(int i = 0; i < num_images; i++)
+    {
+        Mat full = imread(files[i], IMREAD_COLOR);
+        if(full.empty())
+        {
+            STICHER_DBG_ERR("can not read " << files[i]);
+            return false;
+        }
+        full_sizes[i] = full.size();
+
+        double scale = 0;
+        double megapix[2] = {work_megapix, seam_megapix};
+        for(int k = 0; k < 2; k++)
+            scale = max(scale, megapix[k] > 0 ? min(1.0, sqrt(megapix[k] * 1e6 / full.size().area())) : 1.0);
+        reduce_scale[i] = scale;
+
+        if(scale < 1)
+            resize(full, reduced[i], Size(), scale, scale, INTER_AREA);
+        else
+            reduced[i] = full;
+    }
+
+    update_image_scale(reduced);
+
+    STICHER_DBG_OUT("----Calcualating CameraParams----");
+    calculate_camera_params(reduced);
+
+    STICHER_DBG_OUT("----Prepare exposure compensate gains, find seam----");
+    prepare_compose(reduced);
+    reduced.clear();
+
+    STICHER_DBG_OUT("----Composing tiles----");
+    float warped_image_scale = get_warped_image_scale(cameras);
+    vector<tiled_source> sources(num_images);
+    vector<Point> corners;
+    vector<Size> sizes;
+    for(int i = 0; i < num_images; i++)
+    {
+        double work_full = work_scale[i] * reduce_scale[i];
+        double compose_full = 1;
+        if(compose_megapix > 0)
+        {
+            compose_full = min(1.0, sqrt(compose_megapix * 1e6 / full_sizes[i].area()));
+            if(std::abs(compose_full - 1) <= 1e-1)
+                compose_full = 1;
+        }
+        double aspect = compose_full / work_full;
+
+        // maps sample the full resolution image, see build_warp_maps
+        tiled_source &src = sources[i];
+        src.warper = makePtr<Rect_spherical_warper>(warped_image_scale * static_cast<float>(aspect));
+        cameras[i].K().convertTo(src.K, CV_32F);
+        float swa = (float)(1.0 / work_full);
+        src.K(0,0) *= swa; src.K(0,2) *= swa;
+        src.K(1,1) *= swa; src.K(1,2) *= swa;
+        src.roi = src.warper->warpRoi(full_sizes[i], src.K, cameras[i].R);
+        src.warper->set_camera_params(src.K, cameras[i].R);
+        corners.push_back(src.roi.tl());
+        sizes.push_back(src.roi.size());
+
+        src.seam_ratio = seam_work_aspect[i] / aspect;
+        src.seam_corner = corners_prepare[i];
+        dilate(warped_mask_prepare[i], src.seam_mask, Mat());
+
+        src.gain = exposure_gain(i, corners_prepare[i], warped_mask_prepare[i].size(), prepare_maps[i].mask);
+    }
+    pano_rect = resultRoi(corners, sizes);
+
+    if(!sink.begin(pano_rect.size(), tile_size))
+        return false;
+
+    Source_image_cache cache(files, cache_bytes, full_sizes);
+    int cols = (pano_rect.width + tile_size - 1) / tile_size;
+    int rows = (pano_rect.height + tile_size - 1) / tile_size;
+    for(int row = 0; row < rows; row++)
+    {
+        vector<Mat> tiles(cols);
+        parallel_for_(Range(0, cols), [&](const Range &range)
+        {
+            for(int col = range.start; col < range.end; col++)
+            {
+                Rect tile(pano_rect.x + col * tile_size, pano_rect.y + row * tile_size, tile_size, tile_size);
+                tiles[col] = render_tile(sources, cache, tile & pano_rect);
+            }
+        });
+
+        for(int col = 0; col < cols; col++)
+        {
+            if(!sink.write_tile(col, row, tiles[col]))
+                return false;
+        }
+        STICHER_DBG_OUT("tile row " << row + 1 << " / " << rows);
+    }
+
+    return sink.finish();
+}
+
+Mat Basic_stitcher::render_tile(const vector<tiled_source> &sources, Source_image_cache &cache, Rect tile)
+{
+    // like render_rect, but maps, seam masks and gains are made for this tile only
+    Mat out = Mat::zeros(tile.size(), CV_8UC3);
+
+    Rect region = blend_region(tile);
+
+    Ptr<Blender> tile_blender = create_blender();
+    tile_blender->prepare(region);
+    bool fed = false;
+
+    for(int i = 0; i < sources.size(); i++)
+    {
+        const tiled_source &src = sources[i];
+        Rect sub = region & src.roi;
+        if(sub.area() == 0)
+            continue;
+
+        Mat xmap, ymap;
+        src.warper->build_maps_rect(sub, xmap, ymap);
+
+        Mat full = cache.get(i);
+        if(full.empty())
+            continue;
+
+        Mat patch;
+        remap(full, patch, xmap, ymap, INTER_LINEAR, BORDER_REFLECT);
+
+        // pixels that sample inside the source, what remapping a full mask with INTER_NEAREST gives
+        Mat valid(sub.size(), CV_8U);
+        for(int y = 0; y < sub.height; y++)
+        {
+            const float* xrow = xmap.ptr<float>(y);
+            const float* yrow = ymap.ptr<float>(y);
+            uchar* vrow = valid.ptr<uchar>(y);
+            for(int x = 0; x < sub.width; x++)
+                vrow[x] = (xrow[x] > -0.5f && yrow[x] > -0.5f && xrow[x] < full.cols - 0.5f && yrow[x] < full.rows - 0.5f) ? 255 : 0;
+        }
+
+        // seam scale panorama coordinates are compose scale ones times seam_ratio
+        double r = src.seam_ratio;
+        Mat M = (Mat_<double>(2, 3) << r, 0, r * sub.x - src.seam_corner.x, 0, r, r * sub.y - src.seam_corner.y);
+        Mat seam_mask, gain;
+        warpAffine(src.seam_mask, seam_mask, M, sub.size(), INTER_LINEAR | WARP_INVERSE_MAP, BORDER_CONSTANT);
+        warpAffine(src.gain, gain, M, sub.size(), INTER_LINEAR | WARP_INVERSE_MAP, BORDER_REPLICATE);
+        stitch_kernels::apply_gain<uchar, 3>(patch, gain);
+
+        Mat patch_s;
+        patch.convertTo(patch_s, CV_16S);
+        tile_blender->feed(patch_s, seam_mask & valid, sub.tl());
+        fed = true;
+    }
+    if(!fed)
+        return out;
+
+    Mat region_result, region_mask;
+    tile_blender->blend(region_result, region_mask);
+    region_result(tile - region.tl()).convertTo(out, CV_8U);
+
+    return out;
+}
+
+void Basic_stitcher::set_incremental(bool enable, int tile_size, double threshold, int refresh_interval)
+{
+    incremental = enable;
+    incremental_tile = max(8, tile_size);
+    incremental_threshold = threshold;
+    incremental_refresh = refresh_interval;
+    incremental_small.clear();
+}
+
+bool Basic_stitcher::incremental_needs_full(vector<Mat> &full_img)
+{
+    if(result.empty() || incremental_small.size() != full_img.size())
+        return true;
+    if(incremental_version != cameras_version || compose_maps_version != cameras_version)
+        return true;
+    if(incremental_refresh > 0 && incremental_frames >= incremental_refresh)
+        return true;
+
+    for(int i = 0; i < full_img.size(); i++)
+    {
+        if(compose_maps[i].src_size != full_img[i].size())
+            return true;
+    }
+
+    return false;
+}
+
+Mat Basic_stitcher::make_change_thumbnail(const Mat &full_img)
+{
+    // one pixel per incremental_tile x incremental_tile block of the source, its mean color
+    Size sz((full_img.cols + incremental_tile - 1) / incremental_tile, (full_img.rows + incremental_tile - 1) / incremental_tile);
+    Mat thumb;
+    resize(full_img, thumb, sz, 0, 0, INTER_AREA);
+    return thumb;
+}
+
+void Basic_stitcher::incremental_reset(vector<Mat> &full_img)
+{
+    // Remember the rendered sources and, for every panorama tile of every camera, the block of source
+    // tiles its compose map samples from
+    int t = incremental_tile;
+    incremental_small.clear();
+    incremental_deps.clear();
+
+    for(int i = 0; i < full_img.size(); i++)
+    {
+        incremental_small.push_back(make_change_thumbnail(full_img[i]));
+        Size thumb_size = incremental_small[i].size();
+
+        Rect roi = compose_maps[i].roi;
+        Point first((int)floor((double)(roi.x - pano_rect.x) / t), (int)floor((double)(roi.y - pano_rect.y) / t));
+        Point last((roi.br().x - 1 - pano_rect.x) / t, (roi.br().y - 1 - pano_rect.y) / t);
+
+        tile_deps deps;
+        deps.first_tile = first;
+        deps.src_tiles.create(last.y - first.y + 1, last.x - first.x + 1);
+
+        Mat xmap = compose_maps[i].xmap.getMat(ACCESS_READ);
+        Mat ymap = compose_maps[i].ymap.getMat(ACCESS_READ);
+        Mat mask = compose_maps[i].mask.getMat(ACCESS_READ);
+
+        for(int ty = first.y; ty <= last.y; ty++)
+        {
+            for(int tx = first.x; tx <= last.x; tx++)
+            {
+                Vec4i &dep = deps.src_tiles(ty - first.y, tx - first.x);
+                dep = Vec4i(-1, -1, -1, -1);
+
+                Rect tile(pano_rect.x + tx * t, pano_rect.y + ty * t, t, t);
+                Rect local = (tile & roi) - roi.tl();
+                if(local.area() == 0 || countNonZero(mask(local)) == 0)
+                    continue;
+
+                double min_x, max_x, min_y, max_y;
+                minMaxLoc(xmap(local), &min_x, &max_x, 0, 0, mask(local));
+                minMaxLoc(ymap(local), &min_y, &max_y, 0, 0, mask(local));
+                dep[0] = max(0, min(thumb_size.width - 1, cvFloor((min_x - 1) / t)));
+                dep[1] = max(0, min(thumb_size.height - 1, cvFloor((min_y - 1) / t)));
+                dep[2] = max(0, min(thumb_size.width - 1, cvFloor((max_x + 1) / t)));
+                dep[3] = max(0, min(thumb_size.height - 1, cvFloor((max_y + 1) / t)));
+            }
+        }
+        incremental_deps.push_back(deps);
+    }
+
+    incremental_version = cameras_version;
+    incremental_frames = 0;
+}
+
+void Basic_stitcher::compose_incremental(vector<Mat> &full_img)
+{
+    int t = incremental_tile;
+    Size grid_size((pano_rect.width + t - 1) / t, (pano_rect.height + t - 1) / t);
+    Mat_<uchar> dirty_pano(grid_size, (uchar)0);
+
+    for(int i = 0; i < full_img.size(); i++)
+    {
+        Mat thumb = make_change_thumbnail(full_img[i]);
+        Mat diff;
+        absdiff(thumb, incremental_small[i], diff);
+        if(diff.channels() > 1)
+        {
+            diff = diff.reshape(1, diff.rows * diff.cols);
+            reduce(diff, diff, 1, REDUCE_MAX);
+            diff = diff.reshape(1, thumb.rows);
+        }
+        Mat dirty_src = diff > incremental_threshold;
+        if(countNonZero(dirty_src) == 0)
+            continue;
+
+        // only changed blocks are taken over, so slow changes below the threshold still add up
+        thumb.copyTo(incremental_small[i], dirty_src);
+
+        Mat dirty_sum;
+        integral(dirty_src / 255, dirty_sum, CV_32S);
+
+        const tile_deps &deps = incremental_deps[i];
+        for(int y = 0; y < deps.src_tiles.rows; y++)
+        {
+            for(int x = 0; x < deps.src_tiles.cols; x++)
+            {
+                Vec4i dep = deps.src_tiles(y, x);
+                if(dep[0] < 0)
+                    continue;
+                int count = dirty_sum.at<int>(dep[3] + 1, dep[2] + 1) - dirty_sum.at<int>(dep[1], dep[2] + 1)
+                          - dirty_sum.at<int>(dep[3] + 1, dep[0]) + dirty_sum.at<int>(dep[1], dep[0]);
+                Point tile = deps.first_tile + Point(x, y);
+                if(count > 0 && tile.x >= 0 && tile.y >= 0 && tile.x < grid_size.width && tile.y < grid_size.height)
+                    dirty_pano(tile) = 1;
+            }
+        }
+    }
+
+    int dirty_tiles = countNonZero(dirty_pano);
+    STICHER_DBG_OUT("incremental compose, " << dirty_tiles << " of " << grid_size.area() << " tiles changed");
+    if(dirty_tiles == 0)
+        return;
+
+    if(dirty_tiles * 2 > grid_size.area())
+    {
+        compose(full_img);
+        for(int i = 0; i < full_img.size(); i++)
+            incremental_small[i] = make_change_thumbnail(full_img[i]);
+        return;
+    }
+
+    // the previous panorama was handed out already, patch a copy of it
+    result = result.clone();
+
+    // recompose connected groups of dirty tiles as one region each
+    Mat labels, stats, centroids;
+    int num_labels = connectedComponentsWithStats(dirty_pano, labels, stats, centroids, 8, CV_32S);
+    for(int l = 1; l < num_labels; l++)
+    {
+        Rect tiles(stats.at<int>(l, CC_STAT_LEFT), stats.at<int>(l, CC_STAT_TOP), stats.at<int>(l, CC_STAT_WIDTH), stats.at<int>(l, CC_STAT_HEIGHT));
+        Rect rect = Rect(pano_rect.x + tiles.x * t, pano_rect.y + tiles.y * t, tiles.width * t, tiles.height * t) & pano_rect;
+
+        Mat region = compose_rect(full_img, rect, true);
+        region.copyTo(result(rect - pano_rect.tl()));
+    }
+    update_outputs();
 }
 
 Mat Basic_stitcher::stitcher_do_all(vector<Mat> &imgs)
@@ -394,4 +2166,390 @@ Mat Basic_stitcher::stitcher_do_all(vector<Mat> &imgs)
     
     STICHER_DBG_OUT("done");
     return result;
-}
\ No newline at end of file
+}
+
+void Basic_stitcher::set_drift_check(int interval, double threshold, int sample_step)
+{
+    drift_interval = interval;
+    drift_threshold = threshold;
+    drift_sample_step = max(1, sample_step);
+}
+
+double Basic_stitcher::measure_alignment_error()
+{
+    vector<Mat> warped, masks;
+    vector<Rect> rois;
+    if(compose_maps_yuv)
+    {
+        for(int i = 0; i < yuv_warped_luma.size(); i++)
+        {
+            warped.push_back(yuv_warped_luma[i]);
+            masks.push_back(compose_maps[i].mask.getMat(ACCESS_READ));
+            rois.push_back(compose_maps[i].roi);
+        }
+    }
+    else
+    {
+        for(int i = 0; i < warped_compose.size(); i++)
+        {
+            warped.push_back(warped_compose[i].getMat(ACCESS_READ));
+            masks.push_back(warped_mask_compose[i].getMat(ACCESS_READ));
+        }
+        rois = rois_compose;
+    }
+
+    return alignment_error(warped, masks, rois);
+}
+
+double Basic_stitcher::alignment_error(const vector<Mat> &warped, const vector<Mat> &masks, const vector<Rect> &rois)
+{
+    // Only the pixels where two warped images overlap are examined, sampled every drift_sample_step pixels,
+    // so the cost is a small fraction of warping and blending the same frame
+    double error_sum = 0;
+    double weight_sum = 0;
+    int step = drift_sample_step;
+
+    for(int i = 0; i < warped.size(); i++)
+    {
+        for(int j = i + 1; j < warped.size(); j++)
+        {
+            Rect overlap = rois[i] & rois[j];
+            if(overlap.width < step || overlap.height < step)
+                continue;
+
+            Rect roi_i = overlap - rois[i].tl();
+            Rect roi_j = overlap - rois[j].tl();
+            Size sampled_size(overlap.width / step, overlap.height / step);
+
+            Mat img_i, img_j, mask_i, mask_j;
+            resize(warped[i](roi_i), img_i, sampled_size, 0, 0, INTER_NEAREST);
+            resize(warped[j](roi_j), img_j, sampled_size, 0, 0, INTER_NEAREST);
+            resize(masks[i](roi_i), mask_i, sampled_size, 0, 0, INTER_NEAREST);
+            resize(masks[j](roi_j), mask_j, sampled_size, 0, 0, INTER_NEAREST);
+            if(img_i.channels() == 3)
+            {
+                cvtColor(img_i, img_i, COLOR_BGR2GRAY);
+                cvtColor(img_j, img_j, COLOR_BGR2GRAY);
+            }
+
+            Mat valid = mask_i & mask_j;
+            int count = countNonZero(valid);
+            if(count < 16)
+                continue;
+
+            // zero mean NCC, insensitive to the remaining exposure difference between the two cameras
+            Scalar mean_i, stddev_i, mean_j, stddev_j;
+            meanStdDev(img_i, mean_i, stddev_i, valid);
+            meanStdDev(img_j, mean_j, stddev_j, valid);
+            if(stddev_i[0] < 1.0 || stddev_j[0] < 1.0)
+                continue;
+
+            double cross = 0;
+            for(int y = 0; y < valid.rows; y++)
+            {
+                const uchar* v = valid.ptr<uchar>(y);
+                const uchar* a = img_i.ptr<uchar>(y);
+                const uchar* b = img_j.ptr<uchar>(y);
+                for(int x = 0; x < valid.cols; x++)
+                {
+                    if(v[x])
+                        cross += (a[x] - mean_i[0]) * (b[x] - mean_j[0]);
+                }
+            }
+            double ncc = cross / (count * stddev_i[0] * stddev_j[0]);
+
+            error_sum += (1.0 - ncc) * count;
+            weight_sum += count;
+        }
+    }
+
+    if(weight_sum == 0)
+        return 0;
+
+    return error_sum / weight_sum;
+}
+
+bool Basic_stitcher::check_calibration_drift()
+{
+    if(drift_interval <= 0 || (compose_maps_yuv ? yuv_warped_luma.empty() : warped_compose.empty()))
+        return recalibration_requested;
+
+    if(frame_count % drift_interval != 0 && drift_baseline >= 0)
+        return recalibration_requested;
+
+    double error = measure_alignment_error();
+    if(drift_baseline < 0)
+    {
+        drift_baseline = error;
+        STICHER_DBG_OUT("alignment error baseline : " << error);
+    }
+    else if(error - drift_baseline > drift_threshold)
+    {
+        STICHER_DBG_OUT("alignment error " << error << " exceeds baseline " << drift_baseline << ", request recalibration");
+        recalibration_requested = true;
+    }
+
+    return recalibration_requested;
+}
+
+bool Basic_stitcher::need_recalibration()
+{
+    return recalibration_requested || cameras.empty();
+}
+
+void Basic_stitcher::request_recalibration()
+{
+    recalibration_requested = true;
+}
+
+void Basic_stitcher::cancel_recalibration()
+{
+    recalibration_requested = false;
+}
+
+void Basic_stitcher::recalibrate(vector<Mat> &imgs, bool yuv)
+{
+    vector<Mat> luma, u, v, half;
+    if(yuv)
+        split_yuv(imgs, luma, u, v, half);
+    vector<Mat> &calib_imgs = yuv ? half : imgs;
+
+    update_image_scale(calib_imgs);
+    STICHER_DBG_OUT("----Calcualating CameraParams----");
+    calculate_camera_params(calib_imgs);
+}
+
+Mat Basic_stitcher::stitcher_do_frame(vector<Mat> &imgs)
+{
+    update_image_scale(imgs);
+
+    if(need_recalibration())
+    {
+        STICHER_DBG_OUT("----Calcualating CameraParams----");
+        calculate_camera_params(imgs);
+    }
+
+    if(incremental && !incremental_needs_full(imgs))
+    {
+        STICHER_DBG_OUT("----Recompose changed tiles only----");
+        compose_incremental(imgs);
+        incremental_frames++;
+    }
+    else
+    {
+        STICHER_DBG_OUT("----Prepare exposure compensate gains, find seam----");
+        prepare_compose(imgs);
+
+        STICHER_DBG_OUT("----Warping for compose, apply exposure gain, blending----");
+        compose(imgs);
+
+        if(incremental)
+            incremental_reset(imgs);
+    }
+
+    check_calibration_drift();
+    frame_count++;
+
+    return result;
+}
+
+void Basic_stitcher::split_yuv(vector<Mat> &yuv, vector<Mat> &luma, vector<Mat> &u, vector<Mat> &v, vector<Mat> &half)
+{
+    // plane views into the I420 buffers, plus the half resolution BGR image every other stage runs on
+    int num_images = yuv.size();
+    luma.assign(num_images, Mat());
+    u.assign(num_images, Mat());
+    v.assign(num_images, Mat());
+    half.assign(num_images, Mat());
+    for(int i = 0; i < num_images; i++)
+    {
+        Size size(yuv[i].cols, yuv[i].rows * 2 / 3);
+        luma[i] = yuv[i].rowRange(0, size.height);
+        u[i] = Mat(size.height / 2, size.width / 2, CV_8UC1, yuv[i].ptr(size.height));
+        v[i] = Mat(size.height / 2, size.width / 2, CV_8UC1, yuv[i].ptr(size.height) + (size.width / 2) * (size.height / 2));
+
+        Mat luma_half, planes;
+        resize(luma[i], luma_half, u[i].size(), 0, 0, INTER_AREA);
+        Mat channels[3] = {luma_half, u[i], v[i]};
+        merge(channels, 3, planes);
+        cvtColor(planes, half[i], COLOR_YUV2BGR);
+    }
+}
+
+Mat Basic_stitcher::stitcher_do_frame_yuv(vector<Mat> &yuv)
+{
+    vector<Mat> luma, u, v, half;
+    split_yuv(yuv, luma, u, v, half);
+    update_image_scale(half);
+
+    if(need_recalibration())
+    {
+        STICHER_DBG_OUT("----Calcualating CameraParams----");
+        calculate_camera_params(half);
+    }
+
+    STICHER_DBG_OUT("----Prepare exposure compensate gains, find seam----");
+    prepare_compose(half);
+
+    STICHER_DBG_OUT("----Warping and feathering luma and chroma planes----");
+    update_yuv_maps(luma);
+    Mat pano = compose_yuv(luma, u, v);
+
+    check_calibration_drift();
+    frame_count++;
+
+    return pano;
+}
+
+void Basic_stitcher::update_yuv_maps(const vector<Mat> &luma)
+{
+    // luma compose maps sample planes twice the size of the half resolution images the scales belong to
+    bool maps_changed = (yuv_luma.size() != luma.size());
+    if(!compose_maps_yuv || !warp_maps_valid(luma, compose_maps, compose_maps_version))
+    {
+        STICHER_DBG_OUT("building luma and chroma warp maps");
+        vector<double> luma_aspect;
+        for(int i = 0; i < compose_work_aspect.size(); i++)
+            luma_aspect.push_back(compose_work_aspect[i] * 2);
+        build_warp_maps(luma, cameras, luma_aspect, compose_maps, 2.0);
+        compose_maps_version = cameras_version;
+        compose_maps_yuv = true;
+
+        vector<Point> corners;
+        vector<Size> sizes;
+        for (int i = 0; i < compose_maps.size(); ++i)
+        {
+            corners.push_back(compose_maps[i].roi.tl());
+            sizes.push_back(compose_maps[i].roi.size());
+        }
+        pano_rect = resultRoi(corners, sizes);
+        maps_changed = true;
+    }
+
+    update_blend_masks();
+    update_gain_maps();
+    int num_images = compose_maps.size();
+
+    if(maps_changed)
+    {
+        // output planes start on an even luma position so that chroma pixel (x, y) sits on luma (2x, 2y)
+        yuv_origin = Point(pano_rect.x & ~1, pano_rect.y & ~1);
+        yuv_size = Size((pano_rect.br().x - yuv_origin.x + 1) & ~1, (pano_rect.br().y - yuv_origin.y + 1) & ~1);
+
+        // chroma maps are the luma ones taken at even output positions, in chroma coordinates of a centered
+        // 4:2:0 sample; they depend on the cameras only
+        yuv_luma.assign(num_images, yuv_plane());
+        yuv_chroma.assign(num_images, yuv_plane());
+        for(int i = 0; i < num_images; i++)
+        {
+            Rect roi = compose_maps[i].roi - yuv_origin;
+            yuv_luma[i].roi = roi;
+
+            Point tl((roi.x + 1) / 2, (roi.y + 1) / 2);
+            Point br((roi.br().x + 1) / 2, (roi.br().y + 1) / 2);
+            yuv_plane &chroma = yuv_chroma[i];
+            chroma.roi = Rect(tl, br);
+            chroma.xmap.create(chroma.roi.size(), CV_32F);
+            chroma.ymap.create(chroma.roi.size(), CV_32F);
+
+            Mat xmap = compose_maps[i].xmap.getMat(ACCESS_READ);
+            Mat ymap = compose_maps[i].ymap.getMat(ACCESS_READ);
+            for(int y = 0; y < chroma.roi.height; y++)
+            {
+                int ly = 2 * (chroma.roi.y + y) - roi.y;
+                const float* lx_row = xmap.ptr<float>(ly);
+                const float* ly_row = ymap.ptr<float>(ly);
+                float* cx_row = chroma.xmap.ptr<float>(y);
+                float* cy_row = chroma.ymap.ptr<float>(y);
+                for(int x = 0; x < chroma.roi.width; x++)
+                {
+                    int lx = 2 * (chroma.roi.x + x) - roi.x;
+                    cx_row[x] = (lx_row[lx] - 0.5f) * 0.5f;
+                    cy_row[x] = (ly_row[lx] - 0.5f) * 0.5f;
+                }
+            }
+        }
+        yuv_seams_version = -1;
+    }
+
+    if(yuv_seams_version != seams_version)
+    {
+        // feather weights follow the seams, chroma takes the luma weight at the same even positions
+        STICHER_DBG_OUT("building luma and chroma feather weights");
+        make_feather_weights(yuv_origin, yuv_size, yuv_luma_feather);
+
+        Size chroma_size(yuv_size.width / 2, yuv_size.height / 2);
+        Mat chroma_sum = Mat::zeros(chroma_size, CV_32F);
+        for(int i = 0; i < num_images; i++)
+        {
+            yuv_plane &chroma = yuv_chroma[i];
+            Rect roi = yuv_luma[i].roi;
+            chroma.weight.create(chroma.roi.size(), CV_32F);
+            for(int y = 0; y < chroma.roi.height; y++)
+            {
+                const float* lw_row = yuv_luma_feather[i].ptr<float>(2 * (chroma.roi.y + y) - roi.y);
+                float* cw_row = chroma.weight.ptr<float>(y);
+                for(int x = 0; x < chroma.roi.width; x++)
+                    cw_row[x] = lw_row[2 * (chroma.roi.x + x) - roi.x];
+            }
+            Mat sum_roi = chroma_sum(chroma.roi);
+            sum_roi += chroma.weight;
+        }
+
+        // uncovered chroma is neutral gray, not green
+        Mat uncovered = (chroma_sum < 0.5f);
+        yuv_chroma_base = Mat::zeros(chroma_size, CV_32F);
+        yuv_chroma_base.setTo(Scalar::all(128), uncovered);
+
+        yuv_seams_version = seams_version;
+        yuv_gains_version = -1;
+    }
+
+    // exposure gains act on luma only
+    if(yuv_gains_version != gain_maps_version)
+    {
+        for(int i = 0; i < num_images; i++)
+            multiply(yuv_luma_feather[i], gain_maps[i], yuv_luma[i].weight);
+        yuv_gains_version = gain_maps_version;
+    }
+}
+
+Mat Basic_stitcher::compose_yuv(const vector<Mat> &luma, const vector<Mat> &u, const vector<Mat> &v)
+{
+    Size chroma_size(yuv_size.width / 2, yuv_size.height / 2);
+    Mat acc_y = Mat::zeros(yuv_size, CV_32F);
+    Mat acc_u = yuv_chroma_base.clone();
+    Mat acc_v = yuv_chroma_base.clone();
+    yuv_warped_luma.assign(drift_interval > 0 ? luma.size() : 0, Mat());
+
+    for(int i = 0; i < luma.size(); i++)
+    {
+        Mat luma_patch;
+        remap(luma[i], luma_patch, compose_maps[i].xmap.getMat(ACCESS_READ), compose_maps[i].ymap.getMat(ACCESS_READ), INTER_LINEAR, BORDER_REFLECT);
+        Mat acc_roi = acc_y(yuv_luma[i].roi);
+        stitch_kernels::accumulate_weighted<uchar, 1>(luma_patch, yuv_luma[i].weight, acc_roi);
+        if(drift_interval > 0)
+            yuv_warped_luma[i] = luma_patch;
+
+        const yuv_plane &chroma = yuv_chroma[i];
+        Mat patch;
+        remap(u[i], patch, chroma.xmap, chroma.ymap, INTER_LINEAR, BORDER_REFLECT);
+        acc_roi = acc_u(chroma.roi);
+        stitch_kernels::accumulate_weighted<uchar, 1>(patch, chroma.weight, acc_roi);
+
+        remap(v[i], patch, chroma.xmap, chroma.ymap, INTER_LINEAR, BORDER_REFLECT);
+        acc_roi = acc_v(chroma.roi);
+        stitch_kernels::accumulate_weighted<uchar, 1>(patch, chroma.weight, acc_roi);
+    }
+
+    // write the planes straight into one I420 buffer
+    Mat out(yuv_size.height * 3 / 2, yuv_size.width, CV_8UC1);
+    Mat out_y = out.rowRange(0, yuv_size.height);
+    Mat out_u(chroma_size, CV_8UC1, out.ptr(yuv_size.height));
+    Mat out_v(chroma_size, CV_8UC1, out.ptr(yuv_size.height) + chroma_size.area());
+    stitch_kernels::store_accumulated<uchar, 1>(acc_y, out_y);
+    stitch_kernels::store_accumulated<uchar, 1>(acc_u, out_u);
+    stitch_kernels::store_accumulated<uchar, 1>(acc_v, out_v);
+
+    return out;
+}
@@ -4,6 +4,9 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <sstream>
+#include <cfloat>
+#include <cstdlib>
 #include "opencv2/opencv_modules.hpp"
 #include <opencv2/core/utility.hpp>
 #include "opencv2/imgcodecs.hpp"
@@ -16,8 +19,12 @@
 #include "opencv2/stitching/detail/matchers.hpp"
 #include "opencv2/stitching/detail/motion_estimators.hpp"
 #include "opencv2/stitching/detail/seam_finders.hpp"
+#include "opencv2/stitching/detail/util.hpp"
 #include "opencv2/stitching/detail/warpers.hpp"
 #include "opencv2/stitching/warpers.hpp"
+#include "opencv2/imgproc/detail/gcgraph.hpp"
+#include "tile_io.hpp"
+#include "stitch_kernels.hpp"
 
 #define STITCHER_DEBUG_PRINT
 
@@ -29,52 +36,210 @@
 #define STICHER_DBG_OUT(x)
 #endif
 
+// Graph cut seams solved pair by pair on the overlap crops only. Pairs are greedily edge colored so that no
+// two pairs of one batch share an image, then every batch runs on cv::parallel_for_. Crops are converted to
+// CV_32F inside the pair job, so 8-bit input images are never converted as a whole.
+class Parallel_graph_cut_seam_finder : public cv::detail::SeamFinder
+{
+    public:
+    Parallel_graph_cut_seam_finder(int cost_type_ = cv::detail::GraphCutSeamFinderBase::COST_COLOR
+                                    , float terminal_cost_ = 10000.f, float bad_region_penalty_ = 1000.f);
+
+    void                                    find                    (const std::vector<cv::UMat> &src
+                                                                    , const std::vector<cv::Point> &corners
+                                                                    , std::vector<cv::UMat> &masks);
+
+    private:
+    int cost_type;
+    float terminal_cost;
+    float bad_region_penalty;
+};
+
+// Video seams. The first frame (or any frame after the geometry changed) is solved by a full graph cut,
+// following frames start from the previous seam: only pixels within band_width of it are free, each pays
+// temporal_cost for switching owner, the rest keep last frame's owner. Colors are compared in [0, 1].
+// New cameras reset it. Coherence holds between the frames one stitcher sees, so a video goes through a single one.
+class Temporal_seam_finder : public cv::detail::SeamFinder
+{
+    public:
+    Temporal_seam_finder(int band_width_ = 8, float temporal_cost_ = 0.3f);
+
+    void                                    find                    (const std::vector<cv::UMat> &src
+                                                                    , const std::vector<cv::Point> &corners
+                                                                    , std::vector<cv::UMat> &masks);
+    void                                    reset                   ();
+
+    private:
+    void                                    find_in_pair            (const cv::Mat &img1, const cv::Mat &img2
+                                                                    , cv::Mat &mask1, cv::Mat &mask2
+                                                                    , const cv::Mat &prev1, const cv::Mat &prev2
+                                                                    , cv::Rect rect1, cv::Rect rect2);
+
+    int band_width;
+    float temporal_cost;
+    cv::Ptr<cv::detail::SeamFinder> initial_finder;
+    std::vector<cv::Rect> prev_rects;
+    std::vector<cv::Mat> prev_masks;
+};
+
+// Spherical warper that builds the inverse maps of an arbitrary panorama rectangle, so a large panorama can be
+// mapped tile by tile instead of through full size maps. The camera is set once, after that build_maps_rect
+// only reads the warper and may run for many tiles at once.
+class Rect_spherical_warper : public cv::detail::SphericalWarper
+{
+    public:
+    Rect_spherical_warper(float scale) : cv::detail::SphericalWarper(scale) {}
+
+    void                                    set_camera_params       (cv::InputArray K, cv::InputArray R);
+    void                                    build_maps_rect         (cv::Rect dst_rect, cv::Mat &xmap, cv::Mat &ymap) const;
+};
+
 class Basic_stitcher
 {
     public:
-    Basic_stitcher(bool use_cuda = false)
+    // Pipeline presets, from the quality-maximal combination to the cheapest one usable per video frame
+    enum pipeline_preset
+    {
+        PRESET_QUALITY,     // BundleAdjusterRay, GraphCut(COST_COLOR) seam, GAIN_BLOCKS, MULTI_BAND
+        PRESET_BALANCED,    // BundleAdjusterRay capped at 50 iterations, Dp(COLOR) seam, GAIN, MULTI_BAND with 3 bands
+        PRESET_REALTIME     // no bundle adjustment, Voronoi seam, GAIN, BLEND_FEATHER_MAPS
+    };
+
+    // Blend types besides cv::detail::Blender's NO, FEATHER and MULTI_BAND. BLEND_FEATHER_MAPS feathers like
+    // FEATHER with the normalized weights of every camera precomputed (rebuilt only when the seams change) and
+    // the exposure gains folded in (refolded only when they change), so blending a frame is one weighted sum
+    // over the warped images.
+    enum blend_mode
+    {
+        BLEND_FEATHER_MAPS = 16
+    };
+
+    enum seam_type
+    {
+        SEAM_NO,
+        SEAM_VORONOI,
+        SEAM_DP_COLOR,
+        SEAM_DP_COLOR_GRAD,
+        SEAM_GRAPHCUT_COLOR,
+        SEAM_GRAPHCUT_COLOR_GRAD,
+        SEAM_GRAPHCUT_PARALLEL,
+        SEAM_TEMPORAL
+    };
+
+    enum adjust_type
+    {
+        ADJUST_NO,
+        ADJUST_RAY,
+        ADJUST_REPROJ
+    };
+
+    // Which camera pairs can overlap. Only those pairs are matched.
+    enum rig_topology
+    {
+        TOPOLOGY_ALL,       // every pair, O(N^2)
+        TOPOLOGY_RING,      // cameras i and i +- 1..range around a closed ring
+        TOPOLOGY_RANGE,     // cameras i and i + 1..range, open chain
+        TOPOLOGY_LIST       // explicit adjacency list
+    };
+
+    Basic_stitcher(bool use_cuda_ = false, pipeline_preset preset = PRESET_QUALITY)
     {
+        use_cuda = use_cuda_;
         set_megapix(0.6, 0.1, -1);
         match_conf = 0.3;
+        set_drift_check(0);
+        frame_count = 0;
+        drift_baseline = -1;
+        recalibration_requested = false;
+        set_rig_topology(TOPOLOGY_ALL);
+        set_overlap_features(false);
+        set_adjust_budget(false);
+        cameras_version = 0;
+        prepare_maps_version = -1;
+        compose_maps_version = -1;
+        compose_maps_yuv = false;
+        blend_masks_version = -1;
+        gain_maps_version = -1;
+        incremental_version = -1;
+        seams_version = 0;
+        gains_version = 0;
+        feather_seams_version = -1;
+        feather_gains_version = -1;
+        yuv_seams_version = -1;
+        yuv_gains_version = -1;
+        incremental_frames = 0;
+        set_incremental(false);
 
         if(!use_cuda)
         {
             finder          = cv::makePtr<cv::detail::OrbFeaturesFinder>();;
+            overlap_finder  = cv::makePtr<cv::detail::OrbFeaturesFinder>(cv::Size(1, 1), 500);
             matcher         = cv::makePtr<cv::detail::BestOf2NearestMatcher>(false, 0.3f);;
             estimator       = cv::makePtr<cv::detail::HomographyBasedEstimator>();
-            adjuster        = cv::makePtr<cv::detail::BundleAdjusterRay>();
             warper_creator  = cv::makePtr<cv::SphericalWarper>();
-            seam_finder     = cv::makePtr<cv::detail::GraphCutSeamFinder>(cv::detail::GraphCutSeamFinderBase::COST_COLOR);
-            compensator     = cv::detail::ExposureCompensator::createDefault(cv::detail::ExposureCompensator::GAIN_BLOCKS);
-            blender         = cv::detail::Blender::createDefault(cv::detail::Blender::MULTI_BAND, false);
         }
         else
         {
             finder          = cv::makePtr<cv::detail::SurfFeaturesFinderGpu>();;
+            overlap_finder  = finder;
             matcher         = cv::makePtr<cv::detail::BestOf2NearestMatcher>(true, 0.3f);;
             estimator       = cv::makePtr<cv::detail::HomographyBasedEstimator>();
-            adjuster        = cv::makePtr<cv::detail::BundleAdjusterRay>();
 #ifdef HAVE_OPENCV_CUDAWARPING
             warper_creator  = cv::makePtr<cv::SphericalWarperGpu>();
 #else
             warper_creator  = cv::makePtr<cv::SphericalWarper>();
 #endif
-#ifdef HAVE_OPENCV_CUDALEGACY
-            seam_finder     = cv::makePtr<cv::detail::GraphCutSeamFinderGpu>(cv::detail::GraphCutSeamFinderBase::COST_COLOR);
-#else
-            seam_finder     = cv::makePtr<cv::detail::GraphCutSeamFinder>(cv::detail::GraphCutSeamFinderBase::COST_COLOR);
-#endif
-            compensator     = cv::detail::ExposureCompensator::createDefault(cv::detail::ExposureCompensator::GAIN_BLOCKS);
-            blender         = cv::detail::Blender::createDefault(cv::detail::Blender::MULTI_BAND, true);
         }
+
+        set_preset(preset);
     }
 
+    // Runtime selection of the pipeline, either a whole preset or single components.
+    // set_option accepts the same choices by name ("preset", "seam", "expos", "blend", "ba", "ba_iters",
+    // "topology", "topology_range", "overlap_features", "ba_budget_ms", "incremental") so deployments can
+    // switch them from the command line.
+    void                                    set_preset              (pipeline_preset preset);
+    void                                    set_seam_finder         (seam_type type);
+    void                                    set_exposure_compensator(int type);
+    void                                    set_blender             (int type, int num_bands = 5);
+    void                                    set_bundle_adjuster     (adjust_type type, int max_iterations = 0);
+    bool                                    set_option              (const std::string &name, const std::string &value);
+
+    void                                    set_rig_topology        (rig_topology topology_, int range = 1);
+    void                                    set_rig_topology        (const std::vector<std::pair<int, int> > &adjacency);
+    cv::Mat_<uchar>                         make_match_mask         (int num_images);
+
+    // On recalibration detect features only in the bands predicted to overlap a topology neighbour,
+    // using the previous camera params. Every band is searched with its own 500 feature ORB budget.
+    void                                    set_overlap_features    (bool enable, int margin = 16);
+    std::vector<std::vector<cv::Rect> >     predict_overlap_rois    (const std::vector<cv::Size> &work_sizes);
+
+    // Recalibration cost bound. With warm_start the adjuster starts from the current camera params instead of
+    // the homography estimate. A non zero iteration or millisecond budget runs it in chunks of chunk_iterations
+    // and stops early once one chunk improves the RMS reprojection error by less than min_error_delta pixels.
+    void                                    set_adjust_budget       (bool warm_start, int max_iterations = 0, double max_ms = 0
+                                                                    , double min_error_delta = 0.01, int chunk_iterations = 10);
+
     void                                    set_megapix             (double work_megapix_ = 0.6, double seam_megapix_ = 0.1, double compose_megapix_ = -1);
     void                                    update_image_scale      (std::vector<cv::Mat> &full_img);
-    std::vector<cv::detail::ImageFeatures>  finding_features        (const std::vector<cv::Mat> &imgs);
+    // Largest of the work, seam and compose scales for an input of full_size, i.e. the smallest fraction
+    // of the full resolution an input may be decoded at without changing any stage's resolution
+    double                                  required_input_scale    (cv::Size full_size);
+    std::vector<cv::detail::ImageFeatures>  finding_features        (const std::vector<cv::Mat> &imgs
+                                                                    , const std::vector<std::vector<cv::Rect> > &rois = std::vector<std::vector<cv::Rect> >());
     std::vector<cv::detail::MatchesInfo>    pairwise_matching       (const std::vector<cv::detail::ImageFeatures> &features);
+    float                                   get_warped_image_scale  (const std::vector<cv::detail::CameraParams> &cameras);
     std::vector<cv::detail::CameraParams>   estimate_camera_params  (const std::vector<cv::detail::ImageFeatures> &features
                                                                     , const std::vector<cv::detail::MatchesInfo> &pairwise_matches);
+    std::vector<cv::detail::CameraParams>   refine_camera_params    (const std::vector<cv::detail::ImageFeatures> &features
+                                                                    , const std::vector<cv::detail::MatchesInfo> &pairwise_matches
+                                                                    , const std::vector<cv::detail::CameraParams> &initial);
+    void                                    adjust_camera_params    (const std::vector<cv::detail::ImageFeatures> &features
+                                                                    , const std::vector<cv::detail::MatchesInfo> &pairwise_matches
+                                                                    , std::vector<cv::detail::CameraParams> &cameras);
+    double                                  compute_reprojection_error(const std::vector<cv::detail::ImageFeatures> &features
+                                                                    , const std::vector<cv::detail::MatchesInfo> &pairwise_matches
+                                                                    , const std::vector<cv::detail::CameraParams> &cameras);
     void                                    warping_for_prepare_composition(const std::vector<cv::Mat> &images
                                                                     , const std::vector<cv::detail::CameraParams> &cameras
                                                                     , std::vector<cv::Point> &corners_out
@@ -103,6 +268,12 @@ class Basic_stitcher
     void                                    calculate_camera_params (std::vector<cv::Mat> &full_img);
     std::vector<cv::detail::CameraParams>   get_camera_params       ();
     void                                    set_camera_params       (std::vector<cv::detail::CameraParams> &cameras_);
+    // Calibration bundle shared between processes (FileStorage YAML/XML). The params are at work scale, so
+    // the loading side must use the same work megapix; a mismatch is reported and the load refused.
+    bool                                    save_camera_params      (const std::string &file);
+    bool                                    load_camera_params      (const std::string &file);
+
+    std::vector<cv::Mat>                    get_scaled_images       (std::vector<cv::Mat> &full_img, const std::vector<double> &scales);
 
     void                                    prepare_compose         (std::vector<cv::Mat> &full_img);
 
@@ -110,15 +281,170 @@ class Basic_stitcher
 
     cv::Mat                                 stitcher_do_all         (std::vector<cv::Mat> &imgs);
 
+    // Calibration drift detection. Every 'interval' composed frames the overlap strips of the warped images
+    // (the warped luma planes in the YUV path) are compared (zero mean NCC on a sparse grid) and a recalibration is requested when the misalignment grows
+    // by more than 'threshold' over the value measured right after calibration. interval 0 disables the check.
+    void                                    set_drift_check         (int interval = 1, double threshold = 0.15, int sample_step = 4);
+    double                                  measure_alignment_error ();
+    bool                                    check_calibration_drift ();
+    bool                                    need_recalibration      ();
+    void                                    request_recalibration   ();
+    // Drops a pending request but keeps the drift baseline, for a caller that gets new cameras from elsewhere
+    void                                    cancel_recalibration    ();
+    // Calibrates on imgs without seams, gains or composition. yuv: I420 frames, calibrated on the half
+    // resolution BGR images of stitcher_do_frame_yuv so the cameras fit that path.
+    void                                    recalibrate             (std::vector<cv::Mat> &imgs, bool yuv = false);
+
+    // Video path, calibrates on the first frame or when recalibration was requested, otherwise reuses cameras
+    cv::Mat                                 stitcher_do_frame       (std::vector<cv::Mat> &imgs);
+
+    // Planar YUV 4:2:0 video path, I420 frames in and out (CV_8UC1, rows * 3 / 2). Calibration, seams and gains
+    // run on a half resolution BGR image made from the chroma resolution planes, then luma is warped and blended
+    // at full resolution and chroma at half, through maps subsampled from the luma ones. Gains scale luma only.
+    // Blending is always feathering (createWeightMap weights, normalized once per seam update), the Blenders
+    // only take CV_16SC3.
+    cv::Mat                                 stitcher_do_frame_yuv   (std::vector<cv::Mat> &yuv);
+
+    // Incremental video compositing for mostly static scenes. Source frames are compared block wise
+    // (tile_size pixels, mean color change above threshold), changed blocks are mapped through the cached
+    // compose maps to panorama tiles and only those tiles are recomposed into the previous panorama.
+    // Seams and gains are kept from the last full frame, which is redone every refresh_interval frames.
+    void                                    set_incremental         (bool enable, int tile_size = 64
+                                                                    , double threshold = 6, int refresh_interval = 100);
+    cv::Mat                                 compose_rect            (std::vector<cv::Mat> &full_img, cv::Rect rect
+                                                                    , bool update_warped = false);
+
+    // Extra output resolutions, as fractions of the composed panorama, derived from one Gaussian pyramid of
+    // the blended result instead of another run. get_outputs returns the full result first, then one image
+    // per scale in the given order. Library use only, the command line tool writes the full result alone.
+    void                                    set_output_scales       (const std::vector<double> &scales);
+    std::vector<cv::Mat>                    get_outputs             ();
+
+    // Viewport rendering. prepare_viewports calibrates if needed and finds seams and gains for a frame without
+    // composing it, compose_viewport(s) then render only the requested panorama rectangles (coordinates as
+    // get_pano_rect, CV_8UC3) by inverse mapping through the cached compose maps, several views in parallel.
+    void                                    prepare_viewports       (std::vector<cv::Mat> &imgs);
+    cv::Rect                                get_pano_rect           ();
+    cv::Mat                                 compose_viewport        (std::vector<cv::Mat> &full_img, cv::Rect view);
+    std::vector<cv::Mat>                    compose_viewports       (std::vector<cv::Mat> &full_img
+                                                                    , const std::vector<cv::Rect> &views);
+
+    // Out-of-core composition of still images too large to hold at once. Calibration, seams and gains run on
+    // copies reduced to the work or seam scale, then the panorama is composed at compose scale tile by tile:
+    // a tile warps only the sources whose roi touches it, through maps built for that tile, from a decoded
+    // image cache bounded by cache_bytes. Tiles reach the sink in row major order, one row in memory at a time.
+    bool                                    stitch_tiled            (const std::vector<std::string> &files, Tile_sink &sink
+                                                                    , int tile_size = 512, size_t cache_bytes = (size_t)2 << 30);
+
     private:
+    // Remap tables of one camera from its full resolution image to seam or compose scale, with the
+    // warped full mask and the roi in panorama coordinates. Rebuilt when the camera params change.
+    struct warp_maps
+    {
+        cv::UMat xmap;
+        cv::UMat ymap;
+        cv::UMat mask;
+        cv::Rect roi;
+        cv::Size src_size;
+    };
+
+    void                                    build_warp_maps         (const std::vector<cv::Mat> &images
+                                                                    , const std::vector<cv::detail::CameraParams> &cameras
+                                                                    , const std::vector<double> &dst_work_aspect
+                                                                    , std::vector<warp_maps> &maps, double src_scale = 1.0);
+    bool                                    warp_maps_valid         (const std::vector<cv::Mat> &images
+                                                                    , const std::vector<warp_maps> &maps
+                                                                    , int maps_version);
+
+    // For every panorama tile a camera covers, the inclusive block (x0, y0, x1, y1) of source tiles its
+    // compose map samples from, x0 is -1 for tiles outside the camera's mask
+    struct tile_deps
+    {
+        cv::Point first_tile;
+        cv::Mat_<cv::Vec4i> src_tiles;
+    };
+
+    void                                    update_seams_version    ();
+    void                                    update_gains_version    ();
+    void                                    update_blend_masks      ();
+    void                                    update_gain_maps        ();
+    cv::Mat                                 exposure_gain           (int idx, cv::Point corner, cv::Size size
+                                                                    , const cv::UMat &mask);
+    cv::Ptr<cv::detail::Blender>            create_blender          ();
+    void                                    make_feather_weights    (cv::Point origin, cv::Size size, std::vector<cv::Mat> &weights);
+    void                                    update_feather_weights  ();
+    cv::Mat                                 blend_feather_maps      (std::vector<cv::UMat> &image_warped
+                                                                    , std::vector<cv::Rect> &rois);
+    int                                     blend_margin            ();
+    cv::Rect                                blend_region            (cv::Rect rect);
+    void                                    update_compose_maps     (const std::vector<cv::Mat> &images
+                                                                    , const std::vector<cv::detail::CameraParams> &cameras);
+    struct compose_views
+    {
+        std::vector<cv::Mat> xmap;
+        std::vector<cv::Mat> ymap;
+        std::vector<cv::Mat> blend_mask;
+    };
+
+    void                                    update_outputs          ();
+    compose_views                           get_compose_views       ();
+    cv::Mat                                 render_rect             (const std::vector<cv::Mat> &full_img, cv::Rect rect
+                                                                    , bool update_warped, const compose_views &views);
+    bool                                    incremental_needs_full  (std::vector<cv::Mat> &full_img);
+    cv::Mat                                 make_change_thumbnail   (const cv::Mat &full_img);
+    void                                    incremental_reset       (std::vector<cv::Mat> &full_img);
+    void                                    compose_incremental     (std::vector<cv::Mat> &full_img);
+
+    // Chroma maps and feather weights of the YUV path, roi in output plane coordinates. Luma weights have the
+    // exposure gain folded in; luma maps are compose_maps built from the luma planes.
+    struct yuv_plane
+    {
+        cv::Mat xmap;
+        cv::Mat ymap;
+        cv::Mat weight;
+        cv::Rect roi;
+    };
+
+    double                                  alignment_error         (const std::vector<cv::Mat> &warped
+                                                                    , const std::vector<cv::Mat> &masks
+                                                                    , const std::vector<cv::Rect> &rois);
+    void                                    split_yuv               (std::vector<cv::Mat> &yuv, std::vector<cv::Mat> &luma
+                                                                    , std::vector<cv::Mat> &u, std::vector<cv::Mat> &v
+                                                                    , std::vector<cv::Mat> &half);
+    void                                    update_yuv_maps         (const std::vector<cv::Mat> &luma);
+    cv::Mat                                 compose_yuv             (const std::vector<cv::Mat> &luma
+                                                                    , const std::vector<cv::Mat> &u
+                                                                    , const std::vector<cv::Mat> &v);
+
+    // One source of a tiled composition, at compose scale of its full resolution. Seam mask (dilated) and
+    // gains stay at seam scale and are resampled per tile, seam_ratio is seam per compose panorama pixel.
+    struct tiled_source
+    {
+        cv::Ptr<Rect_spherical_warper> warper;
+        cv::Mat_<float> K;
+        cv::Rect roi;
+        double seam_ratio;
+        cv::Point seam_corner;
+        cv::Mat seam_mask;
+        cv::Mat gain;
+    };
+
+    cv::Mat                                 render_tile             (const std::vector<tiled_source> &sources
+                                                                    , Source_image_cache &cache, cv::Rect tile);
+
     cv::Ptr<cv::detail::FeaturesFinder> finder;
+    cv::Ptr<cv::detail::FeaturesFinder> overlap_finder;
     cv::Ptr<cv::detail::FeaturesMatcher> matcher;
     cv::Ptr<cv::detail::Estimator> estimator;
     cv::Ptr<cv::detail::BundleAdjusterBase> adjuster;
     cv::Ptr<cv::WarperCreator> warper_creator;
     cv::Ptr<cv::detail::SeamFinder> seam_finder;
+    seam_type seam_finder_type;
     cv::Ptr<cv::detail::ExposureCompensator> compensator;
     cv::Ptr<cv::detail::Blender> blender;
+    int blend_type;
+    int blend_bands;
+    bool use_cuda;
 
     std::vector<cv::detail::ImageFeatures> features;
     std::vector<cv::detail::MatchesInfo> pairwise_matches;
@@ -132,12 +458,73 @@ class Basic_stitcher
     std::vector<cv::UMat> warped_mask_compose;
     std::vector<cv::Rect> rois_compose;
     cv::Mat result;
+    std::vector<double> output_scales;
+    std::vector<cv::Mat> outputs;
+    std::vector<warp_maps> prepare_maps;
+    std::vector<warp_maps> compose_maps;
+    int cameras_version;
+    int prepare_maps_version;
+    int compose_maps_version;
+    bool compose_maps_yuv;
+    int seams_version;
+    std::vector<cv::Mat> seam_masks_prev;
+    std::vector<cv::Point> seam_corners_prev;
+    int gains_version;
+    std::vector<cv::Mat> gain_probes_prev;
+    std::vector<cv::UMat> blend_masks;
+    int blend_masks_version;
+    std::vector<cv::Mat> gain_maps;
+    int gain_maps_version;
+    cv::Rect pano_rect;
+
+    std::vector<yuv_plane> yuv_luma;
+    std::vector<yuv_plane> yuv_chroma;
+    cv::Point yuv_origin;
+    cv::Size yuv_size;
+    cv::Mat yuv_chroma_base;
+    std::vector<cv::Mat> yuv_luma_feather;
+    std::vector<cv::Mat> yuv_warped_luma;       // last frame's warped luma, for the drift check
+    int yuv_seams_version;
+    int yuv_gains_version;
+
+    std::vector<cv::Mat> feather_weights;
+    std::vector<cv::Mat> feather_gained;
+    std::vector<cv::Rect> feather_rois;
+    int feather_seams_version;
+    int feather_gains_version;
+
+    bool incremental;
+    int incremental_tile;
+    double incremental_threshold;
+    int incremental_refresh;
+    int incremental_frames;
+    int incremental_version;
+    std::vector<cv::Mat> incremental_small;
+    std::vector<tile_deps> incremental_deps;
 
     double work_megapix;
     double seam_megapix;
     double compose_megapix;
     double match_conf;
 
+    rig_topology topology;
+    int topology_range;
+    std::vector<std::pair<int, int> > topology_pairs;
+    bool overlap_features;
+    int overlap_margin;
+    bool adjust_warm_start;
+    int adjust_max_iterations;
+    double adjust_max_ms;
+    double adjust_min_error_delta;
+    int adjust_chunk_iterations;
+
+    int drift_interval;
+    double drift_threshold;
+    int drift_sample_step;
+    int frame_count;
+    double drift_baseline;
+    bool recalibration_requested;
+
     std::vector<double> work_scale;
     std::vector<double> seam_scale;
     std::vector<double> seam_work_aspect;
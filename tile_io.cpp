@@ -0,0 +1,361 @@
+#include "tile_io.hpp"
+#include "stitcher.hpp"
+
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace cv;
+
+Source_image_cache::Source_image_cache(const vector<string> &files_, size_t max_bytes_, const vector<Size> &sizes_)
+{
+    files = files_;
+    sizes = sizes_;
+    max_bytes = max_bytes_;
+    bytes = 0;
+    pending_bytes = 0;
+}
+
+Mat Source_image_cache::get(int idx)
+{
+    size_t need = (idx < sizes.size()) ? (size_t)sizes[idx].area() * 3 : 0;
+
+    unique_lock<mutex> guard(lock);
+    while(true)
+    {
+        for(list<entry>::iterator it = lru.begin(); it != lru.end(); ++it)
+        {
+            if(it->idx == idx)
+            {
+                lru.splice(lru.begin(), lru, it);
+                return lru.front().img;
+            }
+        }
+
+        // another thread is decoding this image already
+        if(decoding.count(idx))
+        {
+            changed.wait(guard);
+            continue;
+        }
+
+        // make room by evicting, wait for the other decodes when that is not enough
+        while(bytes + pending_bytes + need > max_bytes && !lru.empty())
+        {
+            bytes -= lru.back().img.total() * lru.back().img.elemSize();
+            lru.pop_back();
+        }
+        if(bytes + pending_bytes + need <= max_bytes || pending_bytes == 0)
+            break;
+        changed.wait(guard);
+    }
+
+    decoding.insert(idx);
+    pending_bytes += need;
+    guard.unlock();
+
+    // decode outside the lock
+    Mat img = imread(files[idx], IMREAD_COLOR);
+    if(img.empty())
+        STICHER_DBG_ERR("can not read " << files[idx]);
+
+    guard.lock();
+    decoding.erase(idx);
+    pending_bytes -= need;
+
+    entry e;
+    e.idx = idx;
+    e.img = img;
+    lru.push_front(e);
+    bytes += img.total() * img.elemSize();
+
+    while(bytes + pending_bytes > max_bytes && lru.size() > 1)
+    {
+        bytes -= lru.back().img.total() * lru.back().img.elemSize();
+        lru.pop_back();
+    }
+    changed.notify_all();
+
+    return img;
+}
+
+Raw_tile_sink::Raw_tile_sink(const string &dir_)
+{
+    dir = dir_;
+}
+
+bool Raw_tile_sink::begin(Size pano_size, int tile_size)
+{
+    ofstream header((dir + "/tiles.txt").c_str());
+    if(!header)
+    {
+        STICHER_DBG_ERR("can not write " << dir << "/tiles.txt");
+        return false;
+    }
+
+    int cols = (pano_size.width + tile_size - 1) / tile_size;
+    int rows = (pano_size.height + tile_size - 1) / tile_size;
+    header << pano_size.width << " " << pano_size.height << " " << tile_size << " " << cols << " " << rows << endl;
+
+    return true;
+}
+
+bool Raw_tile_sink::write_tile(int col, int row, const Mat &tile)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/tile_%d_%d.raw", row, col);
+
+    FILE *fp = fopen((dir + name).c_str(), "wb");
+    if(!fp)
+    {
+        STICHER_DBG_ERR("can not write " << dir << name);
+        return false;
+    }
+
+    bool ok = true;
+    size_t row_bytes = tile.cols * tile.elemSize();
+    for(int y = 0; y < tile.rows && ok; y++)
+        ok = (fwrite(tile.ptr(y), 1, row_bytes, fp) == row_bytes);
+    fclose(fp);
+
+    return ok;
+}
+
+bool Raw_tile_sink::finish()
+{
+    return true;
+}
+
+Pyramid_tile_sink::Pyramid_tile_sink(const string &name_, layout layout_, const string &format_, int num_threads, int max_pending)
+{
+    name = name_;
+    tile_layout = layout_;
+    format = format_;
+    tile = 0;
+    max_level = 0;
+    min_level = 0;
+    max_jobs = max_pending;
+    busy = 0;
+    stop = false;
+    failed = false;
+
+    for(int i = 0; i < num_threads; i++)
+        encoders.push_back(thread(&Pyramid_tile_sink::encode_thread, this));
+}
+
+Pyramid_tile_sink::~Pyramid_tile_sink()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    job_ready.notify_all();
+
+    for(int i = 0; i < encoders.size(); i++)
+        encoders[i].join();
+}
+
+void Pyramid_tile_sink::encode_thread()
+{
+    while(true)
+    {
+        encode_job job;
+        {
+            unique_lock<mutex> guard(lock);
+            job_ready.wait(guard, [this]{ return stop || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+            job = jobs.front();
+            jobs.pop();
+            busy++;
+        }
+        job_done.notify_all();
+
+        bool ok = imwrite(job.path, job.tile);
+        if(!ok)
+            STICHER_DBG_ERR("can not write " << job.path);
+
+        {
+            lock_guard<mutex> guard(lock);
+            busy--;
+            if(!ok)
+                failed = true;
+        }
+        job_done.notify_all();
+    }
+}
+
+// an existing directory is fine, the pyramid may be rewritten in place
+static bool make_dir(const string &dir)
+{
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        STICHER_DBG_ERR("can not create " << dir);
+        return false;
+    }
+    return true;
+}
+
+string Pyramid_tile_sink::level_dir(int level)
+{
+    ostringstream dir;
+    if(tile_layout == LAYOUT_DZI)
+        dir << name << "_files/" << level;
+    else
+        dir << name << "/" << level - min_level;
+    return dir.str();
+}
+
+string Pyramid_tile_sink::tile_path(int level, int col, int row)
+{
+    ostringstream path;
+    if(tile_layout == LAYOUT_DZI)
+        path << level_dir(level) << "/" << col << "_" << row << "." << format;
+    else
+        path << level_dir(level) << "/" << col << "/" << row << "." << format;
+    return path.str();
+}
+
+bool Pyramid_tile_sink::begin(Size pano_size, int tile_size)
+{
+    tile = tile_size;
+
+    // level max_level is the full panorama, every coarser level halves it (rounding up) down to 1x1
+    max_level = (int)ceil(log2((double)max(max(pano_size.width, pano_size.height), 1)));
+    level_sizes.assign(max_level + 1, pano_size);
+    for(int level = max_level - 1; level >= 0; level--)
+        level_sizes[level] = Size((level_sizes[level + 1].width + 1) / 2, (level_sizes[level + 1].height + 1) / 2);
+
+    // XYZ zoom 0 is the finest level that fits in a single tile
+    min_level = 0;
+    if(tile_layout == LAYOUT_XYZ)
+    {
+        while(min_level < max_level && (level_sizes[min_level + 1].width <= tile && level_sizes[min_level + 1].height <= tile))
+            min_level++;
+    }
+
+    current_row.assign(max_level + 1, vector<Mat>());
+    pending_row.assign(max_level + 1, vector<Mat>());
+
+    if(!make_dir(tile_layout == LAYOUT_DZI ? name + "_files" : name))
+        return false;
+    for(int level = min_level; level <= max_level; level++)
+    {
+        if(!make_dir(level_dir(level)))
+            return false;
+        if(tile_layout == LAYOUT_XYZ)
+        {
+            int cols = (level_sizes[level].width + tile - 1) / tile;
+            for(int col = 0; col < cols; col++)
+            {
+                ostringstream dir;
+                dir << level_dir(level) << "/" << col;
+                if(!make_dir(dir.str()))
+                    return false;
+            }
+        }
+    }
+
+    if(tile_layout == LAYOUT_DZI)
+    {
+        // written up front so viewers can open the pyramid while it is being filled
+        ofstream dzi((name + ".dzi").c_str());
+        if(!dzi)
+        {
+            STICHER_DBG_ERR("can not write " << name << ".dzi");
+            return false;
+        }
+        dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl;
+        dzi << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" TileSize=\"" << tile
+            << "\" Overlap=\"0\" Format=\"" << format << "\">" << endl;
+        dzi << "  <Size Width=\"" << pano_size.width << "\" Height=\"" << pano_size.height << "\"/>" << endl;
+        dzi << "</Image>" << endl;
+    }
+
+    return true;
+}
+
+bool Pyramid_tile_sink::write_tile(int col, int row, const Mat &tile_img)
+{
+    return add_tile(max_level, col, row, tile_img);
+}
+
+bool Pyramid_tile_sink::add_tile(int level, int col, int row, const Mat &tile_img)
+{
+    {
+        // bounded queue, the compositor waits for the encoders when it runs ahead
+        unique_lock<mutex> guard(lock);
+        job_done.wait(guard, [this]{ return (int)jobs.size() < max_jobs; });
+
+        encode_job job;
+        job.path = tile_path(level, col, row);
+        job.tile = tile_img;
+        jobs.push(job);
+    }
+    job_ready.notify_one();
+
+    if(level == min_level)
+        return !failed;
+
+    current_row[level].push_back(tile_img);
+    int cols = (level_sizes[level].width + tile - 1) / tile;
+    int rows = (level_sizes[level].height + tile - 1) / tile;
+    if(col + 1 < cols)
+        return !failed;
+
+    vector<Mat> done;
+    done.swap(current_row[level]);
+    if(row % 2 == 0 && row + 1 < rows)
+    {
+        pending_row[level].swap(done);
+        return !failed;
+    }
+
+    if(row % 2 == 0)
+        reduce_rows(level, row / 2, done, vector<Mat>());
+    else
+        reduce_rows(level, row / 2, pending_row[level], done);
+    pending_row[level].clear();
+
+    return !failed;
+}
+
+void Pyramid_tile_sink::reduce_rows(int level, int row, const vector<Mat> &upper, const vector<Mat> &lower)
+{
+    // every parent tile is its up to 2x2 children joined and downsampled by two
+    int cols = (level_sizes[level - 1].width + tile - 1) / tile;
+    for(int col = 0; col < cols; col++)
+    {
+        int left = 2 * col;
+        int right = min(2 * col + 1, (int)upper.size() - 1);
+        int width = upper[left].cols + (right != left ? upper[right].cols : 0);
+        int height = upper[left].rows + (lower.empty() ? 0 : lower[left].rows);
+
+        Mat joined(height, width, upper[left].type());
+        upper[left].copyTo(joined(Rect(0, 0, upper[left].cols, upper[left].rows)));
+        if(right != left)
+            upper[right].copyTo(joined(Rect(upper[left].cols, 0, upper[right].cols, upper[right].rows)));
+        if(!lower.empty())
+        {
+            lower[left].copyTo(joined(Rect(0, upper[left].rows, lower[left].cols, lower[left].rows)));
+            if(right != left)
+                lower[right].copyTo(joined(Rect(upper[left].cols, upper[left].rows, lower[right].cols, lower[right].rows)));
+        }
+
+        Mat parent;
+        resize(joined, parent, Size((width + 1) / 2, (height + 1) / 2), 0, 0, INTER_AREA);
+        add_tile(level - 1, col, row, parent);
+    }
+}
+
+bool Pyramid_tile_sink::finish()
+{
+    unique_lock<mutex> guard(lock);
+    job_done.wait(guard, [this]{ return jobs.empty() && busy == 0; });
+
+    return !failed;
+}
@@ -0,0 +1,130 @@
+#ifndef TILE_IO_HPP
+#define TILE_IO_HPP
+
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <queue>
+#include <thread>
+#include <condition_variable>
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+// Full resolution source images for out-of-core composition, decoded on first use and kept in a least
+// recently used cache bounded by max_bytes. get() is thread safe. Every image is decoded by one thread, others
+// asking for it meanwhile wait for that decode. Decodes in flight count against max_bytes with the size given
+// in sizes_ (CV_8UC3), a decode that does not fit next to them waits. An image that is still referenced by a
+// caller stays alive after eviction, so the bound is exceeded by at most the images in use.
+class Source_image_cache
+{
+    public:
+    Source_image_cache(const std::vector<std::string> &files_, size_t max_bytes_
+                    , const std::vector<cv::Size> &sizes_ = std::vector<cv::Size>());
+
+    cv::Mat                                 get                     (int idx);
+
+    private:
+    struct entry
+    {
+        int idx;
+        cv::Mat img;
+    };
+
+    std::vector<std::string> files;
+    std::vector<cv::Size> sizes;
+    size_t max_bytes;
+    size_t bytes;
+    size_t pending_bytes;
+    std::list<entry> lru;
+    std::set<int> decoding;
+    std::mutex lock;
+    std::condition_variable changed;
+};
+
+// Receives the finished CV_8UC3 tiles of a panorama in row major order. Tiles are tile_size square except
+// on the right and bottom border.
+class Tile_sink
+{
+    public:
+    virtual ~Tile_sink() {}
+
+    virtual bool                            begin                   (cv::Size pano_size, int tile_size) = 0;
+    virtual bool                            write_tile              (int col, int row, const cv::Mat &tile) = 0;
+    virtual bool                            finish                  () = 0;
+};
+
+// Raw tile files, dir/tile_<row>_<col>.raw with interleaved BGR bytes, described by dir/tiles.txt
+// ("width height tile_size cols rows").
+class Raw_tile_sink : public Tile_sink
+{
+    public:
+    Raw_tile_sink(const std::string &dir_);
+
+    bool                                    begin                   (cv::Size pano_size, int tile_size);
+    bool                                    write_tile              (int col, int row, const cv::Mat &tile);
+    bool                                    finish                  ();
+
+    private:
+    std::string dir;
+};
+
+// Zoomable tile pyramid written while composing. Every finished row pair of a level is downsampled by two into
+// the next coarser level right away, so each level keeps at most one pending row of tiles, and tiles are encoded
+// on a pool of threads. LAYOUT_DZI writes name.dzi and name_files/<level>/<col>_<row>.<format>, LAYOUT_XYZ
+// writes name/<z>/<x>/<y>.<format> for the levels from one tile up. The compositor's tile_size is used.
+class Pyramid_tile_sink : public Tile_sink
+{
+    public:
+    enum layout
+    {
+        LAYOUT_DZI,
+        LAYOUT_XYZ
+    };
+
+    Pyramid_tile_sink(const std::string &name_, layout layout_ = LAYOUT_DZI, const std::string &format_ = "jpg"
+                    , int num_threads = 4, int max_pending = 64);
+    ~Pyramid_tile_sink();
+
+    bool                                    begin                   (cv::Size pano_size, int tile_size);
+    bool                                    write_tile              (int col, int row, const cv::Mat &tile);
+    bool                                    finish                  ();
+
+    private:
+    struct encode_job
+    {
+        std::string path;
+        cv::Mat tile;
+    };
+
+    bool                                    add_tile                (int level, int col, int row, const cv::Mat &tile);
+    void                                    reduce_rows             (int level, int row, const std::vector<cv::Mat> &upper
+                                                                    , const std::vector<cv::Mat> &lower);
+    std::string                             level_dir               (int level);
+    std::string                             tile_path               (int level, int col, int row);
+    void                                    encode_thread           ();
+
+    std::string name;
+    layout tile_layout;
+    std::string format;
+    int tile;
+    int max_level;
+    int min_level;
+    std::vector<cv::Size> level_sizes;
+    std::vector<std::vector<cv::Mat> > current_row;
+    std::vector<std::vector<cv::Mat> > pending_row;
+
+    std::vector<std::thread> encoders;
+    std::queue<encode_job> jobs;
+    int max_jobs;
+    int busy;
+    bool stop;
+    std::atomic<bool> failed;       // set by the encoders, read by add_tile without the lock
+    std::mutex lock;
+    std::condition_variable job_ready;
+    std::condition_variable job_done;
+};
+
+#endif